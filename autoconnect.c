@@ -0,0 +1,270 @@
+/* port auto-connect rules for jack_midi_clock tools
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+
+#include "autoconnect.h"
+
+#define AC_QUEUE_SIZE (256) ///< pending port registrations
+
+enum {
+  AC_EXACT = 0,
+  AC_GLOB,
+  AC_REGEX
+};
+
+struct ac_rule {
+  char        *pattern;
+  int          type; ///< AC_*
+  regex_t      re;
+  jack_port_t *own;
+};
+
+struct autoconnect {
+  jack_client_t     *client;
+  void             (*wake)(void);
+  struct ac_rule    *rule;
+  int                n_rules;
+  jack_ringbuffer_t *queue;    ///< jack_port_id_t of registered ports
+  volatile int       overflow; ///< queue was full, rescan all ports
+  char              *alias[2];
+};
+
+/**
+ * jack port registration callback, called from jack's notification
+ * thread. jack_connect() must not be called here: hand the port
+ * over to the main thread.
+ */
+static void ac_port_registered (jack_port_id_t port, int reg, void *arg) {
+  autoconnect *ac = (autoconnect*) arg;
+  if (!reg) {
+    return;
+  }
+  if (jack_ringbuffer_write_space(ac->queue) >= sizeof(jack_port_id_t)) {
+    jack_ringbuffer_write(ac->queue, (const char*) &port, sizeof(jack_port_id_t));
+  } else {
+    ac->overflow = 1;
+  }
+  if (ac->wake) {
+    ac->wake();
+  }
+}
+
+autoconnect *autoconnect_new (jack_client_t *client, void (*wake)(void)) {
+  autoconnect *ac = (autoconnect*) calloc(1, sizeof(autoconnect));
+  if (!ac) {
+    return NULL;
+  }
+  ac->client = client;
+  ac->wake = wake;
+  ac->queue = jack_ringbuffer_create(AC_QUEUE_SIZE * sizeof(jack_port_id_t));
+  ac->alias[0] = (char*) malloc(jack_port_name_size());
+  ac->alias[1] = (char*) malloc(jack_port_name_size());
+  if (!ac->queue || !ac->alias[0] || !ac->alias[1]
+      || jack_set_port_registration_callback(client, ac_port_registered, ac)) {
+    fprintf(stderr, "cannot set up port auto-connect\n");
+    autoconnect_free(ac);
+    return NULL;
+  }
+  return ac;
+}
+
+int autoconnect_add (autoconnect *ac, const char *pattern, jack_port_t *own) {
+  struct ac_rule *r;
+
+  if (!(r = (struct ac_rule*) realloc(ac->rule, (ac->n_rules + 1) * sizeof(struct ac_rule)))) {
+    return -1;
+  }
+  ac->rule = r;
+  r = &ac->rule[ac->n_rules];
+  memset(r, 0, sizeof(struct ac_rule));
+  r->own = own;
+
+  if (!strncmp(pattern, "re:", 3)) {
+    int err;
+    r->type = AC_REGEX;
+    if ((err = regcomp(&r->re, pattern + 3, REG_EXTENDED | REG_NOSUB))) {
+      char msg[256];
+      regerror(err, &r->re, msg, sizeof(msg));
+      fprintf(stderr, "invalid port pattern '%s': %s\n", pattern, msg);
+      return -1;
+    }
+  } else if (strpbrk(pattern, "*?[")) {
+    r->type = AC_GLOB;
+  } else {
+    r->type = AC_EXACT;
+  }
+  r->pattern = strdup(pattern);
+  ++ac->n_rules;
+  return 0;
+}
+
+static int ac_match_name (const struct ac_rule *r, const char *name) {
+  switch (r->type) {
+    case AC_REGEX:
+      return regexec(&r->re, name, 0, NULL, 0) == 0;
+    case AC_GLOB:
+      return fnmatch(r->pattern, name, 0) == 0;
+    default:
+      return strcmp(r->pattern, name) == 0;
+  }
+}
+
+/**
+ * @return 1 if the port can be connected to the rule's port
+ * and its name or one of its aliases matches
+ */
+static int ac_match (autoconnect *ac, const struct ac_rule *r, jack_port_t *port) {
+  const int want = (jack_port_flags(r->own) & JackPortIsOutput) ? JackPortIsInput : JackPortIsOutput;
+  int i, n;
+
+  if (jack_port_is_mine(ac->client, port)
+      || !(jack_port_flags(port) & want)
+      || strcmp(jack_port_type(port), jack_port_type(r->own))) {
+    return 0;
+  }
+  if (ac_match_name(r, jack_port_name(port))) {
+    return 1;
+  }
+  n = jack_port_get_aliases(port, ac->alias);
+  for (i = 0; i < n; ++i) {
+    if (ac_match_name(r, ac->alias[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @return 1 if a new connection was made
+ */
+static int ac_connect (autoconnect *ac, const struct ac_rule *r, jack_port_t *port) {
+  const char *name = jack_port_name(port);
+  int rv;
+  if (jack_port_connected_to(r->own, name)) {
+    return 0;
+  }
+  if (jack_port_flags(r->own) & JackPortIsOutput) {
+    rv = jack_connect(ac->client, jack_port_name(r->own), name);
+  } else {
+    rv = jack_connect(ac->client, name, jack_port_name(r->own));
+  }
+  if (rv && rv != EEXIST) {
+    fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(r->own), name);
+    return 0;
+  }
+  return rv == 0;
+}
+
+/**
+ * apply all rules to one port
+ * @return number of new connections
+ */
+static int ac_apply (autoconnect *ac, jack_port_t *port) {
+  int i, n = 0;
+  for (i = 0; i < ac->n_rules; ++i) {
+    if (ac_match(ac, &ac->rule[i], port)) {
+      n += ac_connect(ac, &ac->rule[i], port);
+    }
+  }
+  return n;
+}
+
+void autoconnect_scan (autoconnect *ac) {
+  const char **ports;
+  int i, k;
+
+  if (ac->n_rules == 0 || !(ports = jack_get_ports(ac->client, NULL, NULL, 0))) {
+    return;
+  }
+  for (i = 0; i < ac->n_rules; ++i) {
+    const struct ac_rule *r = &ac->rule[i];
+    short found = 0;
+    for (k = 0; ports[k]; ++k) {
+      jack_port_t *port = jack_port_by_name(ac->client, ports[k]);
+      if (port && ac_match(ac, r, port)) {
+	ac_connect(ac, r, port);
+	found = 1;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "no port matches '%s' (yet), it will be connected when it appears\n", r->pattern);
+    }
+  }
+  jack_free(ports);
+}
+
+void autoconnect_poll (autoconnect *ac) {
+  jack_port_id_t id;
+
+  if (ac->overflow) {
+    const char **ports = jack_get_ports(ac->client, NULL, NULL, 0);
+    int k;
+    ac->overflow = 0;
+    while (jack_ringbuffer_read_space(ac->queue) >= sizeof(jack_port_id_t)) {
+      jack_ringbuffer_read(ac->queue, (char*) &id, sizeof(jack_port_id_t));
+    }
+    for (k = 0; ports && ports[k]; ++k) {
+      jack_port_t *port = jack_port_by_name(ac->client, ports[k]);
+      if (port) {
+	ac_apply(ac, port);
+      }
+    }
+    jack_free(ports);
+    return;
+  }
+
+  while (jack_ringbuffer_read_space(ac->queue) >= sizeof(jack_port_id_t)) {
+    jack_port_t *port;
+    jack_ringbuffer_read(ac->queue, (char*) &id, sizeof(jack_port_id_t));
+    /* the port may already be gone again */
+    if ((port = jack_port_by_id(ac->client, id)) && ac_apply(ac, port) > 0) {
+      fprintf(stderr, "connected %s\n", jack_port_name(port));
+    }
+  }
+}
+
+void autoconnect_free (autoconnect *ac) {
+  int i;
+  if (!ac) {
+    return;
+  }
+  for (i = 0; i < ac->n_rules; ++i) {
+    if (ac->rule[i].type == AC_REGEX) {
+      regfree(&ac->rule[i].re);
+    }
+    free(ac->rule[i].pattern);
+  }
+  free(ac->rule);
+  if (ac->queue) {
+    jack_ringbuffer_free(ac->queue);
+  }
+  free(ac->alias[0]);
+  free(ac->alias[1]);
+  free(ac);
+}
@@ -0,0 +1,60 @@
+/* port auto-connect rules for jack_midi_clock tools
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef AUTOCONNECT_H
+#define AUTOCONNECT_H
+
+#include <jack/jack.h>
+
+typedef struct autoconnect autoconnect;
+
+/**
+ * set up a rule set and register jack's port registration callback,
+ * call before jack_activate().
+ * @param wake called from jack's notification thread when a port
+ *        appeared; the main thread should call autoconnect_poll() soon.
+ * @return NULL on error
+ */
+autoconnect *autoconnect_new (jack_client_t *client, void (*wake)(void));
+
+/**
+ * add a connection rule.
+ * @param pattern port name or alias, a glob pattern if it contains any
+ *        of '*?[', or a POSIX extended regular expression prefixed "re:"
+ * @param own port to connect: matching ports of the same type and
+ *        opposite direction, that belong to other clients, are connected.
+ * @return 0 on success, -1 if the pattern is invalid (a message is printed)
+ */
+int autoconnect_add (autoconnect *ac, const char *pattern, jack_port_t *own);
+
+/**
+ * connect all existing ports that match a rule, call after jack_activate().
+ */
+void autoconnect_scan (autoconnect *ac);
+
+/**
+ * connect ports that were registered since the last call,
+ * main thread only. Cheap if there are none.
+ */
+void autoconnect_poll (autoconnect *ac);
+
+void autoconnect_free (autoconnect *ac);
+
+#endif
@@ -18,8 +18,6 @@
  *
  */
 
-//#define JACK_TRANSPORT_SYNC_CHECK // not rt-safe
-
 #ifdef WIN32
 #include <windows.h>
 #include <pthread.h>
@@ -33,27 +31,104 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #ifndef WIN32
 #include <signal.h>
 #include <pthread.h>
 #endif
+#include <semaphore.h>
 
 #include <jack/jack.h>
 #include <jack/transport.h>
 #include <jack/ringbuffer.h>
 #include <jack/midiport.h>
 
-#define RBSIZE 20
-#define METRUM (4) // TODO allow to configure.
+#include "smf.h"
+#include "autoconnect.h"
+
+#define RBSIZE 512
+#define MAX_PORTS (16)
+#define OUTBUF_SIZE (1 << 20) // user-space buffer for machine-readable output
+#define SPARK_LEN (48) // dashboard jitter history, one column per frame
+
+/* internal messages, passed along with MIDI events */
+#define MSG_TRANSPORT (0x01) ///< jack transport snapshot, once per cycle
+#define MSG_ANOMALY   (0x02) ///< anomaly summary, total count of one type in pos
+#define MSG_CONFIG    (0x03) ///< sample-rate or buffer-size changed
+
+/* clock anomalies, classified in realtime context */
+enum {
+  ANOMALY_NONE = 0,
+  ANOMALY_DOUBLE_TICK,     /**< clock before 1/2 the expected period */
+  ANOMALY_SKIPPED_TICK,    /**< clock(s) missing, counted per missing tick */
+  ANOMALY_CLOCK_STOPPED,   /**< clock after stop, before start/continue */
+  ANOMALY_CONTINUE_NO_SPP, /**< continue without prior song position */
+  ANOMALY_LAST
+};
 
 typedef struct {
   uint8_t msg;
-  int pos;
-  unsigned long long int tme;
+  uint8_t port; ///< input port index
+  uint8_t anomaly; ///< ANOMALY_* classification, or type for MSG_ANOMALY
+  int pos;      ///< song position, transport state for MSG_TRANSPORT, sample-rate for MSG_CONFIG
+  unsigned long long int tme; ///< jack frame time
+  uint64_t usecs; ///< jack time (see jack_get_time()) in microseconds
+  double tclk;  ///< MSG_TRANSPORT: transport position in MIDI clocks at tme, MSG_CONFIG: period
+  double trate; ///< MSG_TRANSPORT: MIDI clocks per sample, 0 if stopped
 } timenfo;
 
+/* output formats -- used w/ out_format */
+enum {
+  FMT_TEXT = 0, /**< human readable, single line */
+  FMT_CSV,      /**< comma separated values, one event per line */
+  FMT_JSON,     /**< JSON Lines, one object per event */
+  FMT_BINARY    /**< mclk_stream_header followed by mclk_record structs */
+};
+
+/* binary output format (host byte order) */
+#define MCLK_STREAM_MAGIC "MCLKDUMP"
+#define MCLK_STREAM_VERSION (2)
+
+typedef struct {
+  char     magic[8];    ///< MCLK_STREAM_MAGIC, not zero terminated
+  uint32_t version;     ///< MCLK_STREAM_VERSION
+  uint32_t record_size; ///< sizeof(mclk_record)
+  double   samplerate;
+} mclk_stream_header;
+
+typedef struct {
+  uint64_t tme;     ///< time of event in samples (jack frame time)
+  uint64_t usecs;   ///< jack time of event in microseconds
+  int64_t  wallclock; ///< realtime clock, microseconds since the epoch
+  uint8_t  msg;     ///< MIDI status byte
+  uint8_t  port;    ///< input port index
+  uint8_t  anomaly; ///< ANOMALY_* classification
+  uint8_t  reserved;
+  int32_t  pos;     ///< song position in MIDI beats (0xf2), count (MSG_ANOMALY), sample-rate (MSG_CONFIG)
+  float    bpm;     ///< instantaneous tempo, 0 if unknown
+  float    flt_bpm; ///< DLL filtered tempo, 0 if unknown
+} mclk_record;
+
+/* memory-mapped circular capture file (host byte order) */
+#define MCLK_CAPTURE_MAGIC "MCLKCAPT"
+#define MCLK_CAPTURE_VERSION (3)
+
+typedef struct {
+  char     magic[8];    ///< MCLK_CAPTURE_MAGIC, not zero terminated
+  uint32_t version;     ///< MCLK_CAPTURE_VERSION
+  uint32_t record_size; ///< sizeof(timenfo)
+  uint64_t capacity;    ///< number of records in the ring
+  double   samplerate;
+  uint64_t write_index; ///< total number of records written, updated atomically
+  int64_t  realtime_offset; ///< realtime clock - jack time [usec]
+  uint8_t  reserved[16];
+} mclk_capture_header;  // followed by capacity * timenfo
+
 typedef struct {
   double t0; ///< time of the current Mclk tick
   double t1; ///< expected next Mclk tick
@@ -61,44 +136,282 @@ typedef struct {
   double b, c, omega; ///< DLL filter coefficients
 } DelayLockedLoop;
 
+/* running statistics */
+struct runstats {
+  uint64_t n;
+  double mean, m2; ///< Welford's online variance
+  double min, max;
+};
+
+/* tempo estimators, run side by side on the same clock events */
+#define MAX_ESTIMATORS (8)
+#define LSQ_MAX_WINDOW (384)
+#define EST_SETTLE_TICKS (24)      ///< convergence window, one quarter note
+#define EST_SETTLE_TOLERANCE (5e-4) ///< max relative deviation in window
+
+typedef struct {
+  double t, T;    ///< state: phase [samples], period [samples/clock]
+  double p00, p01, p11; ///< covariance
+  double q, r;    ///< process noise (period), measurement noise
+} KalmanFilter;
+
+typedef struct {
+  double tme[LSQ_MAX_WINDOW]; ///< ring of last event times
+  int window;
+  int n;
+  int idx;
+} LeastSquares;
+
+typedef struct {
+  char name[16];
+  const struct estimator_ops *ops;
+  double param; ///< bandwidth, jitter or window size
+} estimator_cfg;
+
+typedef struct {
+  union {
+    DelayLockedLoop dll;
+    KalmanFilter kf;
+    LeastSquares lsq;
+  } st;
+  double period;    ///< current estimate [samples per clock], 0: unknown
+  uint64_t t_start; ///< time of first clock in sequence
+  double hist[EST_SETTLE_TICKS]; ///< last estimates, to detect convergence
+  int n_hist;
+  double converge_time; ///< [sec] since first clock, < 0 if not converged
+  struct runstats settled; ///< BPM after convergence
+} estimator;
+
+/**
+ * estimator interface, all times in samples
+ * init() is called with the first interval, run() for every following clock.
+ * run() returns the estimated period in samples per clock
+ */
+struct estimator_ops {
+  const char *name;
+  double default_param;
+  void   (*init)(estimator *e, const estimator_cfg *c, double tme, double period);
+  double (*run)(estimator *e, const estimator_cfg *c, double tme);
+};
+
 struct appstate {
   timenfo pt; // previous timeinfo
   DelayLockedLoop dll;
-  uint64_t transport; /// timestamp of transport start/continue, 0 if stopped
+  uint64_t transport; /// timestamp of transport start/continue
   uint64_t sequence; /// beat clock signals since transport-state change
+  uint64_t tempo_start; /// sequence at which tempo tracking (re)started
   int bcnt;  /// last song position
+  short rolling; /// received start/continue, but no stop
+  double phase_clk; /// last phase error (received - jack transport) [MIDI clocks]
+  double phase_sm;  /// last phase error [samples]
+  struct runstats phase_clk_stats;
+  struct runstats phase_sm_stats;
+  estimator est[MAX_ESTIMATORS];
+};
+
+/* per port anomaly detection, process thread only */
+struct rtstate {
+  unsigned long long last_clk; ///< time of previous clock
+  double period;   ///< running clock period [samples], 0: unknown
+  double outlier;  ///< previous out-of-window interval, 0: none
+  short seen;      ///< port received clock or transport messages
+  short stopped;   ///< stop received, no start/continue since
+  short have_spp;  ///< song position received since start/continue
+  short reported;  ///< clock while stopped was forwarded
+  int count[ANOMALY_LAST]; ///< totals by type
+};
+
+/* per port dashboard state (reader thread) */
+struct dashstate {
+  double bpm, flt_bpm; ///< last known tempo, 0 if unknown
+  double dt;           ///< previous clock interval [samples]
+  double jitter;       ///< max interval difference in the current frame [samples]
+  float spark[SPARK_LEN]; ///< jitter history, one value per frame
+  int spark_idx;
+  uint64_t events;
 };
 
+/* per-configuration constants of the process thread, triple buffered.
+ * The sample-rate and buffer-size callbacks fill the back slot and swap
+ * it with the pending one, process() takes the pending slot at the start
+ * of a cycle, so the slot it reads is never written. */
+typedef struct {
+  double         samplerate;
+  jack_nframes_t buffer_size;
+  double         usec_per_frame; ///< nominal, if jack's cycle times are unavailable
+  unsigned long long summary_frames; ///< anomaly summary interval, 0: off
+} rtconfig;
+
 /* jack connection */
 jack_client_t *j_client = NULL;
-jack_port_t   *mclk_input_port;
+jack_port_t   *mclk_input_port[MAX_PORTS];
+autoconnect   *port_rules = NULL;
 
 /* threaded communication */
 static jack_ringbuffer_t *rb = NULL;
-static pthread_mutex_t msg_thread_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
+static sem_t data_ready; ///< posted at most once per jack cycle
 
 /* application state */
 static double samplerate = 48000.0;
-static volatile unsigned long long monotonic_cnt = 0;
+static int64_t realtime_offset = 0; // realtime clock - jack time [usec]
 static int run = 1;
 
 /* options */
 static char newline = '\r'; // or '\n';
 static short keeplastclk = 1;  // print newline on events
 static double dll_bandwidth = 6.0; // 1/Hz
+static int nports = 1;
+static int out_format = FMT_TEXT;
+static double flush_interval = 1.0; // seconds, machine-readable formats only
+static short quiet = 0;
+static char *capture_file = NULL;
+static uint64_t capture_size = 1 << 22; // records, ~24h at 120 BPM
+static char *replay_file = NULL;
+static char *analyze_file_name = NULL;
+static short transport_check = 0;
+static short show_wallclock = 0;
+static short anomalies_only = 0;
+static double summary_interval = -1; // seconds, 0: off, < 0: default
+static int metrum = 4; // beats per bar
+static short dashboard = 0;
+static double refresh_rate = 10.0; // dashboard frames per second
+static char *smf_file = NULL;
+static int smf_ppqn = 960;
+static estimator_cfg est_cfg[MAX_ESTIMATORS];
+static int n_est = 0;
+
+/* last jack transport snapshot (reader thread) */
+static timenfo jt;
+
+/* capture file */
+static mclk_capture_header *capture = NULL;
+static size_t capture_maplen = 0;
+
+/* Standard MIDI File export */
+static smf_writer *smf_out = NULL;
 
-static struct appstate state;
+static struct appstate state[MAX_PORTS];
+static struct rtstate rtstate[MAX_PORTS];
+#define CFG_PENDING (4) ///< flag: the pending slot was not taken yet
+static rtconfig rtcfg[3];
+static rtconfig rtcfg_set;          ///< latest configuration, callback side
+static int rtcfg_back = 0;          ///< callback side
+static int rtcfg_pending = 1;       ///< shared, | CFG_PENDING
+static int rtcfg_front = 2;         ///< process() side
+static int anomaly_total[MAX_PORTS][ANOMALY_LAST]; ///< last summary (reader thread)
+static struct dashstate dash[MAX_PORTS];
 static void print_time_event(struct appstate *s, timenfo *t);
 
+/* jack cycle timing, used to timestamp events */
+struct cycletime {
+  unsigned long long frames; ///< jack frame time at cycle start, extended to 64bit
+  uint64_t usecs;            ///< jack time at cycle start
+  double usec_per_frame;     ///< estimated by jack's DLL
+};
+
+static void count_anomaly(struct rtstate *a, int type, int n) {
+  a->count[type] += n;
+}
+
+/**
+ * classify a clock or transport message, O(1) per event.
+ * The next clock is expected within [0.5, 1.5] periods of the previous one,
+ * the running period is a moving average of in-window intervals.
+ * Two consecutive out-of-window intervals of similar length are a tempo
+ * change rather than an anomaly: the period is re-learned.
+ * @return ANOMALY_NONE or the ANOMALY_* type of the event
+ */
+static int classify_event(struct rtstate *a, timenfo *t) {
+  int rv = ANOMALY_NONE;
+  int n = 1;
+  a->seen = 1;
+
+  switch (t->msg) {
+    case 0xf2:
+      a->have_spp = 1;
+      return ANOMALY_NONE;
+    case 0xfa:
+      a->stopped = 0;
+      a->have_spp = 0;
+      return ANOMALY_NONE;
+    case 0xfb:
+      if (!a->have_spp) {
+	rv = ANOMALY_CONTINUE_NO_SPP;
+	count_anomaly(a, rv, 1);
+      }
+      a->stopped = 0;
+      a->have_spp = 0;
+      return rv;
+    case 0xfc:
+      /* clock may pause while stopped */
+      a->stopped = 1;
+      a->reported = 0;
+      a->last_clk = 0;
+      return ANOMALY_NONE;
+    case 0xf8:
+      break;
+    default:
+      return ANOMALY_NONE;
+  }
+
+  if (a->last_clk > 0 && t->tme > a->last_clk) {
+    const double dt = t->tme - a->last_clk;
+    if (a->period <= 0) {
+      a->period = dt;
+    } else if (dt < 0.5 * a->period) {
+      rv = ANOMALY_DOUBLE_TICK;
+    } else if (dt > 1.5 * a->period) {
+      rv = ANOMALY_SKIPPED_TICK;
+      n = (int) floor(dt / a->period + .5) - 1;
+    }
+    if (rv == ANOMALY_NONE) {
+      a->period += 0.125 * (dt - a->period);
+      a->outlier = 0;
+    } else if (a->outlier > 0 && fabs(dt - a->outlier) < 0.1 * dt) {
+      /* tempo change */
+      a->period = dt;
+      a->outlier = 0;
+      rv = ANOMALY_NONE;
+    } else {
+      a->outlier = dt;
+    }
+  } else if (a->last_clk > 0) {
+    rv = ANOMALY_DOUBLE_TICK; // same time
+  }
+  a->last_clk = t->tme;
+
+  if (rv != ANOMALY_NONE) {
+    count_anomaly(a, rv, n);
+  }
+
+  if (a->stopped) {
+    count_anomaly(a, ANOMALY_CLOCK_STOPPED, 1);
+    if (rv == ANOMALY_NONE && !a->reported) {
+      /* forward only the first clock after stop */
+      a->reported = 1;
+      rv = ANOMALY_CLOCK_STOPPED;
+    }
+  }
+  return rv;
+}
+
+static void queue_event(timenfo *t) {
+  if (jack_ringbuffer_write_space(rb) >= sizeof(timenfo)) {
+    jack_ringbuffer_write(rb, (void *) t, sizeof(timenfo));
+  }
+}
+
 /**
  * parse Midi Beat Clock events
- * enqueue to ring buffer and wake-up 'dump' thread
+ * enqueue to ring buffer, the 'dump' thread is woken up
+ * once per cycle by process()
+ * @param snap pending transport snapshot, queued before the first event
+ * @return 1 if an event was queued, 0 otherwise
  */
-static void process_jmidi_event(jack_midi_event_t *ev, unsigned long long mfcnt) {
+static int process_jmidi_event(jack_midi_event_t *ev, int port, struct cycletime *ct, timenfo *snap) {
   timenfo tnfo;
   memset(&tnfo, 0, sizeof(timenfo));
-  if (ev->size != 1 && !((ev->size == 3 && ev->buffer[0] == 0xf2 ))) return;
+  if (ev->size != 1 && !((ev->size == 3 && ev->buffer[0] == 0xf2 ))) return 0;
 
   switch(ev->buffer[0]) {
     case 0xf2: // position
@@ -110,39 +423,204 @@ static void process_jmidi_event(jack_midi_event_t *ev, unsigned long long mfcnt)
     case 0xfc: // stop
       break;
     default:
-      return;
+      return 0;
   }
 
   tnfo.msg = ev->buffer[0];
-  tnfo.tme = mfcnt + ev->time;
-#ifdef JACK_TRANSPORT_SYNC_CHECK
-  print_time_event(&state, &tnfo);
-#else
-  if (jack_ringbuffer_write_space(rb) >= sizeof(timenfo)) {
-    jack_ringbuffer_write(rb, (void *) &tnfo, sizeof(timenfo));
+  tnfo.port = port;
+  tnfo.tme = ct->frames + ev->time;
+  tnfo.usecs = ct->usecs + llrint(ev->time * ct->usec_per_frame);
+  tnfo.anomaly = classify_event(&rtstate[port], &tnfo);
+
+  if (anomalies_only && !smf_file && !capture_file && tnfo.anomaly == ANOMALY_NONE) {
+    return 0;
+  }
+  if (jack_ringbuffer_write_space(rb) < (snap->msg ? 2 : 1) * sizeof(timenfo)) {
+    return 0;
   }
+  if (snap->msg) {
+    queue_event(snap);
+    snap->msg = 0;
+  }
+  queue_event(&tnfo);
+  return 1;
+}
 
-  if (pthread_mutex_trylock (&msg_thread_lock) == 0) {
-    pthread_cond_signal (&data_ready);
-    pthread_mutex_unlock (&msg_thread_lock);
+/**
+ * enqueue the anomaly totals of all active ports
+ * @return number of queued records
+ */
+static int process_summary(struct cycletime *ct) {
+  timenfo tnfo;
+  int p, i, queued = 0;
+  for (p = 0; p < nports; ++p) {
+    if (!rtstate[p].seen) continue;
+    if (jack_ringbuffer_write_space(rb) < (ANOMALY_LAST - 1) * sizeof(timenfo)) break;
+    memset(&tnfo, 0, sizeof(timenfo));
+    tnfo.msg = MSG_ANOMALY;
+    tnfo.port = p;
+    tnfo.tme = ct->frames;
+    tnfo.usecs = ct->usecs;
+    for (i = ANOMALY_NONE + 1; i < ANOMALY_LAST; ++i) {
+      tnfo.anomaly = i;
+      tnfo.pos = rtstate[p].count[i];
+      queue_event(&tnfo);
+      ++queued;
+    }
   }
-#endif
+  return queued;
+}
+
+/**
+ * announce a new sample-rate or buffer-size to the reader.
+ * Clock periods in samples are not comparable across sample-rates:
+ * anomaly detection re-learns the period.
+ * @return number of queued records
+ */
+static int process_config(struct cycletime *ct, const rtconfig *cfg, short rate_changed) {
+  timenfo tnfo;
+  int p;
+  if (rate_changed) {
+    for (p = 0; p < nports; ++p) {
+      rtstate[p].last_clk = 0;
+      rtstate[p].period = 0;
+      rtstate[p].outlier = 0;
+    }
+  }
+  if (jack_ringbuffer_write_space(rb) < sizeof(timenfo)) {
+    return 0;
+  }
+  memset(&tnfo, 0, sizeof(timenfo));
+  tnfo.msg = MSG_CONFIG;
+  tnfo.tme = ct->frames;
+  tnfo.usecs = ct->usecs;
+  tnfo.pos = cfg->samplerate;
+  tnfo.tclk = cfg->buffer_size;
+  queue_event(&tnfo);
+  return 1;
+}
+
+/**
+ * sample jack transport state and position at cycle start.
+ * jack_transport_query() is realtime safe if called
+ * from the process thread.
+ */
+static void process_transport(struct cycletime *ct, timenfo *snap) {
+  jack_position_t xpos;
+  timenfo tnfo;
+  memset(&tnfo, 0, sizeof(timenfo));
+
+  const jack_transport_state_t xstate = jack_transport_query(j_client, &xpos);
+
+  tnfo.msg = MSG_TRANSPORT;
+  tnfo.tme = ct->frames;
+  tnfo.usecs = ct->usecs;
+  if ((xpos.valid & JackPositionBBT) && xpos.ticks_per_beat > 0 && xpos.frame_rate > 0) {
+    /* same as jack_midi_clock: 24 MIDI clocks per jack beat */
+    const double beats =
+      (xpos.bar - 1) * xpos.beats_per_bar + (xpos.beat - 1)
+      + xpos.tick / xpos.ticks_per_beat;
+    const double clk_per_sample = 24.0 * xpos.beats_per_minute / (60.0 * xpos.frame_rate);
+    const jack_nframes_t bbt_offset = (xpos.valid & JackBBTFrameOffset) ? xpos.bbt_offset : 0;
+    tnfo.pos   = xstate;
+    tnfo.trate = (xstate == JackTransportRolling) ? clk_per_sample : 0;
+    tnfo.tclk  = 24.0 * beats - bbt_offset * tnfo.trate;
+  } else {
+    tnfo.pos   = -1;
+  }
+  memcpy(snap, &tnfo, sizeof(timenfo));
+}
+
+/**
+ * take the pending configuration, if any, for this cycle (process thread)
+ */
+static const rtconfig *rtconfig_acquire(void) {
+  if (__atomic_load_n(&rtcfg_pending, __ATOMIC_RELAXED) & CFG_PENDING) {
+    rtcfg_front = __atomic_exchange_n(&rtcfg_pending, rtcfg_front, __ATOMIC_ACQ_REL) & ~CFG_PENDING;
+  }
+  return &rtcfg[rtcfg_front];
 }
 
 /**
  * jack process callback
  */
 static int process(jack_nframes_t nframes, void *arg) {
-  void *jack_buf = jack_port_get_buffer(mclk_input_port, nframes);
-  int nevents = jack_midi_get_event_count(jack_buf);
-  int n;
+  static unsigned long long frame_time_wrap = 0;
+  static jack_nframes_t last_frame_time = 0;
+  static unsigned long long next_summary = 0;
+  static double seen_rate = 0;
+  static jack_nframes_t seen_buffer_size = 0;
+  const rtconfig *cfg = rtconfig_acquire();
+  struct cycletime ct;
+  timenfo snap;
+  jack_nframes_t cur_frames;
+  jack_time_t cur_usecs, next_usecs;
+  float period_usecs;
+  void *jack_buf[MAX_PORTS];
+  int nevents[MAX_PORTS];
+  int total = 0;
+  int queued = 0;
+  int p, n;
+
+  /* timestamp events with jack's frame time, which is
+   * shared by all clients and correlates to jack_get_time() */
+  if (jack_get_cycle_times(j_client, &cur_frames, &cur_usecs, &next_usecs, &period_usecs) == 0) {
+    ct.usecs = cur_usecs;
+    ct.usec_per_frame = (next_usecs - cur_usecs) / (double) nframes;
+  } else {
+    cur_frames = jack_last_frame_time(j_client);
+    ct.usecs = jack_frames_to_time(j_client, cur_frames);
+    ct.usec_per_frame = cfg->usec_per_frame;
+  }
+  if (cur_frames < last_frame_time) {
+    frame_time_wrap += 1ULL << 32;
+  }
+  last_frame_time = cur_frames;
+  ct.frames = frame_time_wrap + cur_frames;
+
+  if (cfg->samplerate != seen_rate || cfg->buffer_size != seen_buffer_size) {
+    if (seen_rate > 0) {
+      queued += process_config(&ct, cfg, cfg->samplerate != seen_rate);
+      next_summary = 0;
+    }
+    seen_rate = cfg->samplerate;
+    seen_buffer_size = cfg->buffer_size;
+  }
+
+  for (p=0; p < nports; p++) {
+    jack_buf[p] = jack_port_get_buffer(mclk_input_port[p], nframes);
+    nevents[p] = jack_midi_get_event_count(jack_buf[p]);
+    total += nevents[p];
+  }
+
+  /* transport snapshot preceeds the (forwarded) events of the cycle */
+  snap.msg = 0;
+  if (transport_check && total > 0) {
+    process_transport(&ct, &snap);
+  }
+
+  for (p=0; p < nports; p++) {
+    for (n=0; n < nevents[p]; n++) {
+      jack_midi_event_t ev;
+      jack_midi_event_get(&ev, jack_buf[p], n);
+      queued += process_jmidi_event(&ev, p, &ct, &snap);
+    }
+  }
+
+  if (cfg->summary_frames > 0) {
+    if (next_summary == 0) {
+      next_summary = ct.frames + cfg->summary_frames;
+    } else if (ct.frames >= next_summary) {
+      queued += process_summary(&ct);
+      next_summary += cfg->summary_frames;
+    }
+  }
 
-  for (n=0; n < nevents; n++) {
-    jack_midi_event_t ev;
-    jack_midi_event_get(&ev, jack_buf, n);
-    process_jmidi_event(&ev, monotonic_cnt);
+  /* publish all events of this cycle with a single wakeup.
+   * sem_post() is lock-free (futex based) and never blocks. */
+  if (queued > 0) {
+    sem_post(&data_ready);
   }
-  monotonic_cnt += nframes;
   return 0;
 }
 
@@ -151,7 +629,7 @@ static int process(jack_nframes_t nframes, void *arg) {
  */
 void jack_shutdown(void *arg) {
   j_client=NULL;
-  pthread_cond_signal (&data_ready);
+  sem_post (&data_ready);
   fprintf (stderr, "jack server shutdown\n");
 }
 
@@ -168,6 +646,32 @@ void cleanup(void) {
     jack_ringbuffer_free(rb);
   }
   j_client = NULL;
+  sem_destroy (&data_ready);
+}
+
+/**
+ * prepare the process thread's configuration in the back slot
+ * and make it pending. jack serializes the sample-rate and buffer-size
+ * callbacks, there is a single writer.
+ */
+static void rtconfig_update(double rate, jack_nframes_t buffer_size) {
+  rtconfig *c = &rtcfg[rtcfg_back];
+  c->samplerate = rate;
+  c->buffer_size = buffer_size;
+  c->usec_per_frame = 1e6 / rate;
+  c->summary_frames = summary_interval > 0 ? llrint(summary_interval * rate) : 0;
+  rtcfg_set = *c;
+  rtcfg_back = __atomic_exchange_n(&rtcfg_pending, rtcfg_back | CFG_PENDING, __ATOMIC_ACQ_REL) & ~CFG_PENDING;
+}
+
+static int jack_srate_cb(jack_nframes_t nframes, void *arg) {
+  rtconfig_update(nframes, rtcfg_set.buffer_size);
+  return 0;
+}
+
+static int jack_bufsiz_cb(jack_nframes_t nframes, void *arg) {
+  rtconfig_update(rtcfg_set.samplerate, nframes);
+  return 0;
 }
 
 /**
@@ -190,36 +694,68 @@ static int init_jack(const char *client_name) {
     client_name = jack_get_client_name(j_client);
     fprintf (stderr, "jack-client name: `%s'\n", client_name);
   }
+  samplerate = (double) jack_get_sample_rate (j_client);
+  rtconfig_update(samplerate, jack_get_buffer_size (j_client));
+
   jack_set_process_callback (j_client, process, 0);
+  jack_set_sample_rate_callback (j_client, jack_srate_cb, 0);
+  jack_set_buffer_size_callback (j_client, jack_bufsiz_cb, 0);
 
 #ifndef WIN32
   jack_on_shutdown (j_client, jack_shutdown, NULL);
 #endif
-  samplerate = (double) jack_get_sample_rate (j_client);
 
   return (0);
 }
 
 static int jack_portsetup(void) {
-  if ((mclk_input_port = jack_port_register(j_client, "mclk_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
-    fprintf (stderr, "cannot register mclk input port !\n");
-    return (-1);
+  int p;
+  for (p=0; p < nports; p++) {
+    char name[32];
+    if (nports == 1) {
+      strcpy(name, "mclk_in");
+    } else {
+      snprintf(name, sizeof(name), "mclk_in_%d", p + 1);
+    }
+    if ((mclk_input_port[p] = jack_port_register(j_client, name, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
+      fprintf (stderr, "cannot register mclk input port '%s'!\n", name);
+      return (-1);
+    }
   }
   return (0);
 }
 
-static void port_connect(char *mclk_port) {
-  if (mclk_port && jack_connect(j_client, mclk_port, jack_port_name(mclk_input_port))) {
-    fprintf(stderr, "cannot connect port %s to %s\n", mclk_port, jack_port_name(mclk_input_port));
+static void port_rules_wake(void) {
+  sem_post (&data_ready);
+}
+
+/**
+ * connect the ports given on the command line in order, the last
+ * input takes all remaining ones. Matching ports that appear later
+ * are connected by the main loop.
+ */
+static int port_rules_setup(int argc, char **argv) {
+  int i;
+  if (optind >= argc) {
+    return 0;
+  }
+  if (!(port_rules = autoconnect_new(j_client, port_rules_wake))) {
+    return -1;
   }
+  for (i=0; optind < argc; ++i) {
+    if (autoconnect_add(port_rules, argv[optind++], mclk_input_port[i < nports ? i : nports - 1])) {
+      return -1;
+    }
+  }
+  return 0;
 }
 
 /**
  * initialize DLL
  * set current time and period in samples
  */
-static void init_dll(DelayLockedLoop *dll, double tme, double period) {
-  const double omega = 2.0 * M_PI * period / dll_bandwidth / samplerate;
+static void init_dll(DelayLockedLoop *dll, double tme, double period, double bandwidth) {
+  const double omega = 2.0 * M_PI * period / bandwidth / samplerate;
   dll->b = 1.4142135623730950488 * omega;
   dll->c = omega * omega;
 
@@ -241,8 +777,94 @@ static double run_dll(DelayLockedLoop *dll, double tme) {
   return (dll->t1 - dll->t0);
 }
 
+/* DLL estimator, param: bandwidth [1/Hz] */
+static void est_dll_init(estimator *e, const estimator_cfg *c, double tme, double period) {
+  init_dll(&e->st.dll, tme, period, c->param);
+}
+
+static double est_dll_run(estimator *e, const estimator_cfg *c, double tme) {
+  return run_dll(&e->st.dll, tme) * samplerate;
+}
+
+/* 2-state Kalman filter on phase and period,
+ * param: measurement jitter (standard deviation) [ms] */
+static void est_kalman_init(estimator *e, const estimator_cfg *c, double tme, double period) {
+  KalmanFilter *kf = &e->st.kf;
+  const double jitter = c->param * 1e-3 * samplerate;
+  kf->t = tme;
+  kf->T = period;
+  kf->r = jitter * jitter;
+  kf->q = 2e-4 * period * 2e-4 * period; // tempo change per clock
+  kf->p00 = kf->r;
+  kf->p01 = 0;
+  kf->p11 = 0.01 * period * period;
+}
+
+static double est_kalman_run(estimator *e, const estimator_cfg *c, double tme) {
+  KalmanFilter *kf = &e->st.kf;
+  /* predict */
+  kf->t  += kf->T;
+  kf->p00 += 2.0 * kf->p01 + kf->p11;
+  kf->p01 += kf->p11;
+  kf->p11 += kf->q;
+  /* update */
+  const double y = tme - kf->t;
+  const double k0 = kf->p00 / (kf->p00 + kf->r);
+  const double k1 = kf->p01 / (kf->p00 + kf->r);
+  kf->t += k0 * y;
+  kf->T += k1 * y;
+  kf->p11 -= k1 * kf->p01;
+  kf->p01 *= (1.0 - k0);
+  kf->p00 *= (1.0 - k0);
+  return kf->T;
+}
+
+/* least-squares fit over a sliding window, param: window size [clocks] */
+static void lsq_push(LeastSquares *l, double tme) {
+  l->tme[l->idx] = tme;
+  l->idx = (l->idx + 1) % l->window;
+  if (l->n < l->window) l->n++;
+}
+
+static void est_lsq_init(estimator *e, const estimator_cfg *c, double tme, double period) {
+  LeastSquares *l = &e->st.lsq;
+  l->window = (int) c->param;
+  l->n = l->idx = 0;
+  lsq_push(l, tme - period);
+  lsq_push(l, tme);
+}
+
+static double est_lsq_run(estimator *e, const estimator_cfg *c, double tme) {
+  LeastSquares *l = &e->st.lsq;
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int i, oldest;
+
+  lsq_push(l, tme);
+  oldest = (l->idx - l->n + l->window) % l->window;
+
+  /* fit tme = a + b * i, relative to the oldest sample for precision */
+  for (i = 0; i < l->n; ++i) {
+    const double y = l->tme[(oldest + i) % l->window] - l->tme[oldest];
+    sx  += i;
+    sy  += y;
+    sxx += (double) i * i;
+    sxy += i * y;
+  }
+  return (l->n * sxy - sx * sy) / (l->n * sxx - sx * sx);
+}
+
+static const struct estimator_ops estimators[] = {
+  { "dll",    6.0,  est_dll_init,    est_dll_run },
+  { "kalman", 0.5,  est_kalman_init, est_kalman_run },
+  { "lsq",    96.0, est_lsq_init,    est_lsq_run },
+  { NULL, 0, NULL, NULL }
+};
+
 const char *msg_to_string(uint8_t msg) {
   switch(msg) {
+    case MSG_ANOMALY: return "summary";
+    case MSG_CONFIG: return "config";
+    case 0xf2: return "pos";
     case 0xf8: return "clk";
     case 0xfa: return "start";
     case 0xfb: return "continue";
@@ -251,8 +873,18 @@ const char *msg_to_string(uint8_t msg) {
   }
 }
 
-#ifdef JACK_TRANSPORT_SYNC_CHECK
-static const char *jt_to_string(jack_transport_state_t jts) {
+static const char *anomaly_to_string(int type) {
+  switch(type) {
+    case ANOMALY_NONE:            return "";
+    case ANOMALY_DOUBLE_TICK:     return "double-tick";
+    case ANOMALY_SKIPPED_TICK:    return "skipped-tick";
+    case ANOMALY_CLOCK_STOPPED:   return "clock-stopped";
+    case ANOMALY_CONTINUE_NO_SPP: return "continue-no-spp";
+    default: return "??";
+  }
+}
+
+static const char *jt_to_string(int jts) {
   switch(jts) {
     case JackTransportStopped:  return ".";
     case JackTransportRolling:  return ">";
@@ -261,103 +893,1326 @@ static const char *jt_to_string(jack_transport_state_t jts) {
   }
 }
 
-static void print_jt(jack_transport_state_t jts, jack_position_t *jtpos) {
-    if(jtpos->valid & JackPositionBBT) {
-      printf(" %s:%4d|%d|%d",
-	  jt_to_string(jts),
-	  jtpos->bar, jtpos->beat,
-	  (int) floor(4.0 * jtpos->tick / (double) jtpos->ticks_per_beat));
+/**
+ * print jack transport position at the time of the given event
+ * and the phase error of the received clock
+ */
+static void print_jt(struct appstate *s, timenfo *t) {
+  if (jt.msg == MSG_TRANSPORT && jt.pos >= 0) {
+    const double clk = jt.tclk + (t->tme - jt.tme) * jt.trate;
+    const int bp = (int) floor(clk / 6.0);
+    printf(" %s:%4d|%d|%d",
+	jt_to_string(jt.pos),
+	1 + (bp/4/metrum), 1 + ((bp/4)%metrum), bp%4);
+  } else {
+    printf(" X:----|-|-");
+  }
+  if (t->msg == 0xf8 && s->phase_clk_stats.n > 0) {
+    printf(" err: %+6.2f[clk] %+7.1f[sm]", s->phase_clk, s->phase_sm);
+  } else {
+    printf(" err:     ??[clk]      ??[sm]");
+  }
+}
+
+/**
+ * estimate offset of realtime clock to jack time.
+ * jack_get_time() is CLOCK_MONOTONIC based on most systems.
+ */
+static void update_realtime_offset(void) {
+  struct timespec ts;
+  const jack_time_t t0 = jack_get_time();
+  clock_gettime(CLOCK_REALTIME, &ts);
+  const jack_time_t t1 = jack_get_time();
+  realtime_offset = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - (int64_t) ((t0 + t1) / 2);
+}
+
+/**
+ * @return wallclock time of the event in microseconds since the epoch, 0 if unknown
+ */
+static long long wallclock_usec(timenfo *t) {
+  if (t->usecs == 0 || realtime_offset == 0) return 0;
+  return (long long) t->usecs + realtime_offset;
+}
+
+static void print_wallclock(timenfo *t) {
+  const long long wc = wallclock_usec(t);
+  const time_t sec = wc / 1000000;
+  struct tm tm;
+  if (wc == 0 || !localtime_r(&sec, &tm)) {
+    printf(" --:--:--.------");
+    return;
+  }
+  printf(" %02d:%02d:%02d.%06d", tm.tm_hour, tm.tm_min, tm.tm_sec, (int) (wc % 1000000));
+}
+
+static void print_timestamp(timenfo *t, char end) {
+  printf(" @ %lld", t->tme);
+  if (show_wallclock) {
+    print_wallclock(t);
+  }
+  printf("       %c", end);
+}
+
+static void print_estimates(struct appstate *s) {
+  int i;
+  for (i = 0; i < n_est; ++i) {
+    if (s->est[i].period > 0) {
+      printf(" %s: %7.2f", est_cfg[i].name, samplerate * 60.0 / (24.0 * s->est[i].period));
     } else {
-      printf(" X:----|-|-");
+      printf(" %s:      ??", est_cfg[i].name);
     }
+  }
 }
-#endif
 
-static void print_time_event(struct appstate *s, timenfo *t) {
-  double flt_bpm = 0;
-#ifdef JACK_TRANSPORT_SYNC_CHECK
-    jack_position_t jtpos;
-    jack_transport_state_t jts = jack_transport_query(j_client, &jtpos);
-#endif
+/**
+ * @return clocks since tempo tracking started
+ */
+static uint64_t tempo_seq(const struct appstate *s) {
+  return s->sequence - s->tempo_start;
+}
 
-  if (t->msg == 0xf2) {
-    /* song position */
-    s->bcnt = t->pos;
+static void print_port(timenfo *t) {
+  if (nports > 1) {
+    printf("[%2d] ", t->port + 1);
+  }
+}
+
+/**
+ * print flagged event or anomaly summary
+ */
+static void print_text_anomaly(timenfo *t) {
+  int i;
+  if (newline == '\r' && keeplastclk && !anomalies_only) printf("\n");
+  print_port(t);
+  if (t->msg == MSG_ANOMALY) {
+    printf("SUMMARY");
+    for (i = ANOMALY_NONE + 1; i < ANOMALY_LAST; ++i) {
+      printf(" %s: %d", anomaly_to_string(i), anomaly_total[t->port][i]);
+    }
+  } else {
+    printf("ANOMALY (0x%02x) %-8s %-40s", t->msg, msg_to_string(t->msg), anomaly_to_string(t->anomaly));
+  }
+  print_timestamp(t, '\n');
+}
+
+static void print_text_config(timenfo *t) {
+  if (newline == '\r' && keeplastclk && !anomalies_only) printf("\n");
+  printf("CONFIG %6d[Hz] %5.0f[frames/period] %-33s", t->pos, t->tclk, "");
+  print_timestamp(t, '\n');
+}
 
+/**
+ * print human readable event info
+ */
+static void print_text_event(struct appstate *s, timenfo *t, double bpm, double flt_bpm) {
+  if (t->msg == 0xf2) {
     if (newline == '\r' && keeplastclk) printf("\n");
-    fprintf(stdout, "POS (0x%04x) %4d.%d[beats] %4d|%d|%d [BBT@4/4] %-16s",
+    print_port(t);
+    fprintf(stdout, "POS (0x%04x) %4d.%d[beats] %4d|%d|%d [BBT@%d/4] %-16s",
 	t->pos,
 	1 + t->pos/4, t->pos%4,
-	1 + (t->pos/4/METRUM), 1 + ((t->pos/4)%METRUM), t->pos%4,
-	"");
-#ifdef JACK_TRANSPORT_SYNC_CHECK
-      printf("           ");
-#endif
-    fprintf(stdout, " @ %lld       \n", t->tme);
+	1 + (t->pos/4/metrum), 1 + ((t->pos/4)%metrum), t->pos%4,
+	metrum, "");
+    if (transport_check) {
+      printf("%40s", "");
+    }
+    print_timestamp(t, '\n');
   }
   else if (t->msg == 0xfa || t->msg == 0xfb || t->msg == 0xfc) {
-    /* start, stop, continue -> reset */
-    s->sequence = 0;
-    if (t->msg == 0xfc) s->transport = 0; // stop
-    else s->transport = t->tme;
-    if (t->msg == 0xfa) s->bcnt = 0; // start
-
     if (newline == '\r' && keeplastclk) printf("\n");
+    print_port(t);
     fprintf(stdout, "EVENT (0x%02x) %-49s",
 	t->msg, msg_to_string(t->msg));
-#ifdef JACK_TRANSPORT_SYNC_CHECK
-      printf("           ");
-#endif
-    fprintf(stdout, " @ %lld       \n", t->tme);
-  }
-  else if (s->sequence == 1) {
-    /* 2nd event in sequence -> initialize DLL with time difference */
-    init_dll(&s->dll, t->tme, (t->tme - s->pt.tme));
-    flt_bpm = samplerate * 60.0 / (24.0 * (double)(t->tme - s->pt.tme));
-  }
-  else if (s->sequence > 1) {
-    /* run dll, calculate filtered bpm */
-    flt_bpm = 60.0 / (24.0 * run_dll(&s->dll, t->tme));
+    if (transport_check) {
+      printf("%40s", "");
+    }
+    print_timestamp(t, '\n');
   }
 
   /* print clock & bpm */
-  if (t->msg == 0xf8 && s->sequence > 0) {
-    const double samples_per_quarter_note = (t->tme - s->pt.tme) * 24.0;
-    const double bpm = samplerate * 60.0 / samples_per_quarter_note;
+  if (t->msg == 0xf8 && tempo_seq(s) > 0) {
+    print_port(t);
     fprintf(stdout, "CLK cur: %7.2f[BPM] flt: %7.2f[BPM]  dt: %4lld[sm]", bpm, flt_bpm, (t->tme - s->pt.tme));
-    if (s->transport) {
+    if (s->rolling) {
       int bp = s->bcnt + s->sequence / 6;
-      printf(" %4d|%d|%d", 1 + (bp/4/METRUM), 1 + ((bp/4)%METRUM), bp%4);
+      printf(" %4d|%d|%d", 1 + (bp/4/metrum), 1 + ((bp/4)%metrum), bp%4);
     } else {
       printf(" ----|-|-");
     }
-#ifdef JACK_TRANSPORT_SYNC_CHECK
-    print_jt(jts, &jtpos);
-#endif
-    fprintf(stdout, " @ %lld       %c", t->tme, newline);
+    if (transport_check) {
+      print_jt(s, t);
+    }
+    print_estimates(s);
+    print_timestamp(t, newline);
   } else if (t->msg == 0xf8) {
+    print_port(t);
     fprintf(stdout, "CLK cur:      ??[BPM] flt:      ??[BPM]  dt:   ??[sm]         ");
-#ifdef JACK_TRANSPORT_SYNC_CHECK
-    print_jt(jts, &jtpos);
-#endif
-    fprintf(stdout, " @ %lld       %c", t->tme, newline);
+    if (transport_check) {
+      print_jt(s, t);
+    }
+    print_timestamp(t, newline);
   }
+}
 
-  if (t->msg == 0xf8) {
-    memcpy(&s->pt, t, sizeof(timenfo));
-    s->sequence++;
+/**
+ * write machine readable event info
+ * bpm and flt_bpm are zero if unknown.
+ */
+static void write_record(struct appstate *s, timenfo *t, double bpm, double flt_bpm) {
+  const int have_phase = t->msg == 0xf8 && s->phase_clk_stats.n > 0 && jt.pos == JackTransportRolling;
+  const long long wallclock = wallclock_usec(t);
+  mclk_record r;
+  int i;
+
+  switch (out_format) {
+    case FMT_CSV:
+      fprintf(stdout, "%llu,%llu,%lld,%d,%s,",
+	  t->tme, (unsigned long long) t->usecs, wallclock, t->port, msg_to_string(t->msg));
+      if (t->msg == 0xf2 || t->msg == MSG_ANOMALY || t->msg == MSG_CONFIG) fprintf(stdout, "%d", t->pos);
+      fprintf(stdout, ",");
+      if (bpm > 0) fprintf(stdout, "%.4f", bpm);
+      fprintf(stdout, ",");
+      if (flt_bpm > 0) fprintf(stdout, "%.4f", flt_bpm);
+      fprintf(stdout, ",%s", anomaly_to_string(t->anomaly));
+      if (transport_check) {
+	fprintf(stdout, ",");
+	if (have_phase) fprintf(stdout, "%.4f,%.2f", s->phase_clk, s->phase_sm);
+	else fprintf(stdout, ",");
+      }
+      for (i = 0; i < n_est; ++i) {
+	fprintf(stdout, ",");
+	if (t->msg == 0xf8 && s->est[i].period > 0) {
+	  fprintf(stdout, "%.4f", samplerate * 60.0 / (24.0 * s->est[i].period));
+	}
+      }
+      fprintf(stdout, "\n");
+      break;
+
+    case FMT_JSON:
+      fprintf(stdout, "{\"time\":%llu,\"usecs\":%llu,\"wallclock\":%lld,\"port\":%d,\"msg\":\"%s\"",
+	  t->tme, (unsigned long long) t->usecs, wallclock, t->port, msg_to_string(t->msg));
+      if (t->msg == 0xf2) fprintf(stdout, ",\"pos\":%d", t->pos);
+      if (t->msg == MSG_ANOMALY) fprintf(stdout, ",\"count\":%d", t->pos);
+      if (t->msg == MSG_CONFIG) fprintf(stdout, ",\"samplerate\":%d,\"period\":%.0f", t->pos, t->tclk);
+      if (t->anomaly != ANOMALY_NONE) fprintf(stdout, ",\"anomaly\":\"%s\"", anomaly_to_string(t->anomaly));
+      if (bpm > 0) fprintf(stdout, ",\"bpm\":%.4f", bpm);
+      if (flt_bpm > 0) fprintf(stdout, ",\"flt_bpm\":%.4f", flt_bpm);
+      if (have_phase) fprintf(stdout, ",\"phase_clk\":%.4f,\"phase_sm\":%.2f", s->phase_clk, s->phase_sm);
+      for (i = 0; i < n_est; ++i) {
+	if (t->msg == 0xf8 && s->est[i].period > 0) {
+	  fprintf(stdout, ",\"%s\":%.4f", est_cfg[i].name, samplerate * 60.0 / (24.0 * s->est[i].period));
+	}
+      }
+      fprintf(stdout, "}\n");
+      break;
+
+    case FMT_BINARY:
+      memset(&r, 0, sizeof(mclk_record));
+      r.tme     = t->tme;
+      r.usecs   = t->usecs;
+      r.wallclock = wallclock;
+      r.msg     = t->msg;
+      r.port    = t->port;
+      r.anomaly = t->anomaly;
+      r.pos     = (t->msg == 0xf2 || t->msg == MSG_ANOMALY || t->msg == MSG_CONFIG) ? t->pos : -1;
+      r.bpm     = bpm;
+      r.flt_bpm = flt_bpm;
+      fwrite(&r, sizeof(mclk_record), 1, stdout);
+      break;
+
+    default:
+      break;
   }
 }
 
-
-/* TODO: it's not safe to call pthread_cond_signal from a signal handler
- * See http://pubs.opengroup.org/onlinepubs/009695399/functions/pthread_cond_broadcast.html
+/**
+ * write column header or file header for the selected output format
  */
-static void wearedone(int sig) {
-  fprintf(stderr,"caught signal - shutting down.\n");
-  run=0;
-  pthread_cond_signal (&data_ready);
-}
+static void write_header(void) {
+  mclk_stream_header h;
+  int i;
+
+  switch (out_format) {
+    case FMT_CSV:
+      fprintf(stdout, "time,usecs,wallclock,port,msg,pos,bpm,flt_bpm,anomaly%s", transport_check ? ",phase_clk,phase_sm" : "");
+      for (i = 0; i < n_est; ++i) {
+	fprintf(stdout, ",%s", est_cfg[i].name);
+      }
+      fprintf(stdout, "\n");
+      break;
+
+    case FMT_BINARY:
+      memset(&h, 0, sizeof(mclk_stream_header));
+      memcpy(h.magic, MCLK_STREAM_MAGIC, sizeof(h.magic));
+      h.version     = MCLK_STREAM_VERSION;
+      h.record_size = sizeof(mclk_record);
+      h.samplerate  = samplerate;
+      fwrite(&h, sizeof(mclk_stream_header), 1, stdout);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/**
+ * sample-rate changed: intervals measured in samples are no longer
+ * comparable. Restart tempo tracking (DLL, estimators) with the next
+ * clock, the song position is kept.
+ */
+static void config_changed(timenfo *t) {
+  int p;
+  if (t->pos <= 0 || t->pos == samplerate) {
+    return;
+  }
+  if (smf_out) {
+    fprintf(stderr, "Warning: sample-rate changed, MIDI file timing assumes %.0f Hz\n", samplerate);
+  }
+  samplerate = t->pos;
+  for (p = 0; p < MAX_PORTS; ++p) {
+    state[p].tempo_start = state[p].sequence;
+    dash[p].dt = 0;
+  }
+}
+
+/**
+ * update state and calculate tempo for given event
+ * @param bpm set to the instantaneous tempo, 0 if unknown
+ * @param flt_bpm set to the DLL filtered tempo, 0 if unknown
+ */
+static void update_tempo(struct appstate *s, timenfo *t, double *bpm, double *flt_bpm) {
+  *bpm = 0;
+  *flt_bpm = 0;
+
+  if (t->msg == 0xf2) {
+    /* song position */
+    s->bcnt = t->pos;
+  }
+  else if (t->msg == 0xfa || t->msg == 0xfb || t->msg == 0xfc) {
+    /* start, stop, continue -> reset */
+    s->sequence = 0;
+    s->tempo_start = 0;
+    if (t->msg == 0xfc) s->transport = 0; // stop
+    else s->transport = t->tme;
+    s->rolling = (t->msg != 0xfc);
+    if (t->msg == 0xfa) s->bcnt = 0; // start
+  }
+  else if (tempo_seq(s) == 1) {
+    /* 2nd event in sequence -> initialize DLL with time difference */
+    init_dll(&s->dll, t->tme, (t->tme - s->pt.tme), dll_bandwidth);
+    *flt_bpm = samplerate * 60.0 / (24.0 * (double)(t->tme - s->pt.tme));
+  }
+  else if (tempo_seq(s) > 1) {
+    /* run dll, calculate filtered bpm */
+    *flt_bpm = 60.0 / (24.0 * run_dll(&s->dll, t->tme));
+  }
+
+  if (t->msg == 0xf8 && tempo_seq(s) > 0) {
+    const double samples_per_quarter_note = (t->tme - s->pt.tme) * 24.0;
+    *bpm = samplerate * 60.0 / samples_per_quarter_note;
+  }
+}
+
+static void runstats_add(struct runstats *r, double v) {
+  const double d = v - r->mean;
+  if (r->n == 0 || v < r->min) r->min = v;
+  if (r->n == 0 || v > r->max) r->max = v;
+  r->n++;
+  r->mean += d / r->n;
+  r->m2 += d * (v - r->mean);
+}
+
+static double runstats_stddev(struct runstats *r) {
+  return r->n > 1 ? sqrt(r->m2 / (r->n - 1)) : 0;
+}
+
+/**
+ * calculate phase error of received clock relative to jack transport.
+ * call after update_tempo(), before advance_sequence()
+ */
+static void update_phase(struct appstate *s, timenfo *t) {
+  if (t->msg != 0xf8 || !s->rolling) return;
+  if (jt.msg != MSG_TRANSPORT || jt.pos != JackTransportRolling || jt.trate <= 0) return;
+
+  /* 6 MIDI clocks per MIDI beat (song position unit) */
+  const double rx = s->bcnt * 6.0 + s->sequence;
+  const double tx = jt.tclk + (double)(int64_t)(t->tme - jt.tme) * jt.trate;
+
+  s->phase_clk = rx - tx;
+  s->phase_sm  = s->phase_clk / jt.trate;
+  runstats_add(&s->phase_clk_stats, s->phase_clk);
+  runstats_add(&s->phase_sm_stats, s->phase_sm);
+}
+
+static void print_phase_stats(void) {
+  int p;
+  for (p = 0; p < MAX_PORTS; ++p) {
+    struct appstate *s = &state[p];
+    if (s->phase_clk_stats.n == 0) continue;
+    fprintf(stderr, "port %d: phase error (received - jack transport), %llu clock events\n",
+	p + 1, (unsigned long long) s->phase_clk_stats.n);
+    fprintf(stderr, "  mean %+8.3f[clk] stddev %7.3f[clk] min %+8.3f max %+8.3f[clk]\n",
+	s->phase_clk_stats.mean, runstats_stddev(&s->phase_clk_stats),
+	s->phase_clk_stats.min, s->phase_clk_stats.max);
+    fprintf(stderr, "  mean %+8.1f[sm]  stddev %7.1f[sm]  min %+8.1f max %+8.1f[sm]\n",
+	s->phase_sm_stats.mean, runstats_stddev(&s->phase_sm_stats),
+	s->phase_sm_stats.min, s->phase_sm_stats.max);
+  }
+}
+
+/**
+ * run all configured estimators on the given event.
+ * call after update_tempo(), before advance_sequence()
+ */
+static void update_estimators(struct appstate *s, timenfo *t) {
+  int i, k;
+
+  for (i = 0; i < n_est; ++i) {
+    estimator *e = &s->est[i];
+    const estimator_cfg *c = &est_cfg[i];
+
+    if (t->msg == 0xfa || t->msg == 0xfb || t->msg == 0xfc) {
+      /* start, stop, continue -> reset */
+      e->period = 0;
+      e->n_hist = 0;
+      e->converge_time = -1;
+      continue;
+    }
+    if (t->msg != 0xf8) {
+      continue;
+    }
+    if (tempo_seq(s) == 0) {
+      e->t_start = t->tme;
+      e->period = 0;
+      e->n_hist = 0;
+      e->converge_time = -1;
+      continue;
+    }
+    if (tempo_seq(s) == 1) {
+      e->period = t->tme - s->pt.tme;
+      c->ops->init(e, c, t->tme, e->period);
+    } else {
+      e->period = c->ops->run(e, c, t->tme);
+    }
+    if (e->period <= 0) {
+      continue;
+    }
+
+    /* converged: estimate stays within tolerance for EST_SETTLE_TICKS.
+     * A tempo change restarts the measurement */
+    e->hist[e->n_hist++ % EST_SETTLE_TICKS] = e->period;
+    if (e->n_hist >= EST_SETTLE_TICKS) {
+      double mn = e->hist[0], mx = e->hist[0];
+      for (k = 1; k < EST_SETTLE_TICKS; ++k) {
+	if (e->hist[k] < mn) mn = e->hist[k];
+	if (e->hist[k] > mx) mx = e->hist[k];
+      }
+      if (e->converge_time < 0 && (mx - mn) < EST_SETTLE_TOLERANCE * mn) {
+	e->converge_time = (t->tme - e->t_start) / samplerate;
+	memset(&e->settled, 0, sizeof(struct runstats));
+      } else if (e->converge_time >= 0 && (mx - mn) > 4 * EST_SETTLE_TOLERANCE * mn) {
+	e->converge_time = -1;
+	e->t_start = t->tme;
+      }
+    }
+    if (e->converge_time >= 0) {
+      runstats_add(&e->settled, samplerate * 60.0 / (24.0 * e->period));
+    }
+  }
+}
+
+static void print_estimator_stats(void) {
+  int p, i;
+  for (p = 0; p < MAX_PORTS; ++p) {
+    struct appstate *s = &state[p];
+    if (n_est == 0 || s->sequence == 0) continue;
+    fprintf(stderr, "port %d: tempo estimators\n", p + 1);
+    for (i = 0; i < n_est; ++i) {
+      estimator *e = &s->est[i];
+      fprintf(stderr, "  %-12s last: ", est_cfg[i].name);
+      if (e->period > 0) {
+	fprintf(stderr, "%8.3f[BPM]", samplerate * 60.0 / (24.0 * e->period));
+      } else {
+	fprintf(stderr, "      ??[BPM]");
+      }
+      if (e->converge_time >= 0) {
+	fprintf(stderr, " converged after %6.3f[sec]", e->converge_time);
+      } else {
+	fprintf(stderr, " not converged            ");
+      }
+      if (e->settled.n > 1) {
+	fprintf(stderr, " settled stddev %.4f[BPM] (%llu clocks)",
+	    runstats_stddev(&e->settled), (unsigned long long) e->settled.n);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+}
+
+/**
+ * parse estimator specification <name>[:<param>]
+ */
+static int add_estimator(const char *spec) {
+  const struct estimator_ops *ops;
+  const char *sep = strchr(spec, ':');
+  const size_t len = sep ? (size_t)(sep - spec) : strlen(spec);
+  estimator_cfg *c;
+
+  if (n_est >= MAX_ESTIMATORS) {
+    fprintf(stderr, "Too many estimators, at most %d are supported.\n", MAX_ESTIMATORS);
+    return -1;
+  }
+  for (ops = estimators; ops->name; ++ops) {
+    if (strlen(ops->name) == len && !strncmp(spec, ops->name, len)) break;
+  }
+  if (!ops->name) {
+    fprintf(stderr, "Unknown estimator '%s', should be one of dll, kalman, lsq.\n", spec);
+    return -1;
+  }
+
+  c = &est_cfg[n_est];
+  c->ops = ops;
+  c->param = sep ? atof(sep + 1) : ops->default_param;
+
+  if (ops->init == est_dll_init && (c->param < 0.1 || c->param > 100.0)) {
+    fprintf(stderr, "Invalid dll bandwidth, should be 0.1 <= bw <= 100.0.\n");
+    return -1;
+  }
+  if (ops->init == est_kalman_init && (c->param < 0.001 || c->param > 100.0)) {
+    fprintf(stderr, "Invalid kalman jitter, should be 0.001 <= ms <= 100.0.\n");
+    return -1;
+  }
+  if (ops->init == est_lsq_init && (c->param < 3 || c->param > LSQ_MAX_WINDOW)) {
+    fprintf(stderr, "Invalid lsq window, should be 3 <= clocks <= %d.\n", LSQ_MAX_WINDOW);
+    return -1;
+  }
+  snprintf(c->name, sizeof(c->name), "%s:%g", ops->name, c->param);
+  ++n_est;
+  return 0;
+}
+
+static void print_anomaly_stats(struct rtstate *a) {
+  int p, i;
+  for (p = 0; p < MAX_PORTS; ++p) {
+    if (!a[p].seen) continue;
+    fprintf(stderr, "port %d: anomalies", p + 1);
+    for (i = ANOMALY_NONE + 1; i < ANOMALY_LAST; ++i) {
+      fprintf(stderr, " %s: %d", anomaly_to_string(i), a[p].count[i]);
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+/**
+ * remember last Mclk tick, call after update_tempo()
+ */
+static void advance_sequence(struct appstate *s, timenfo *t) {
+  if (t->msg == 0xf8) {
+    memcpy(&s->pt, t, sizeof(timenfo));
+    s->sequence++;
+  }
+}
+
+/* full-screen dashboard.
+ * Events only update per-port state, the screen is rendered by the
+ * main loop at a fixed rate: the cost of a frame is independent of
+ * the event rate.
+ */
+
+static short dash_utf8 = 0;
+
+/**
+ * update dashboard state, O(1) per event
+ */
+static void dash_event(struct appstate *s, timenfo *t, double bpm, double flt_bpm) {
+  struct dashstate *d = &dash[t->port];
+  ++d->events;
+  if (t->msg == 0xfa || t->msg == 0xfb || t->msg == 0xfc) {
+    d->dt = 0;
+  }
+  if (t->msg != 0xf8) {
+    return;
+  }
+  if (bpm > 0 && isfinite(bpm)) d->bpm = bpm;
+  if (flt_bpm > 0) d->flt_bpm = flt_bpm;
+  if (tempo_seq(s) > 0 && t->anomaly == ANOMALY_NONE) {
+    /* interval difference, same as the jitter reported by -A */
+    const double dt = t->tme - s->pt.tme;
+    if (d->dt > 0 && fabs(dt - d->dt) > d->jitter) {
+      d->jitter = fabs(dt - d->dt);
+    }
+    d->dt = dt;
+  }
+}
+
+static short dash_detect_utf8(void) {
+  const char *l = getenv("LC_ALL");
+  if (!l || !*l) l = getenv("LC_CTYPE");
+  if (!l || !*l) l = getenv("LANG");
+  return l && (strstr(l, "UTF-8") || strstr(l, "utf-8") || strstr(l, "UTF8") || strstr(l, "utf8"));
+}
+
+static void dash_start(void) {
+  dash_utf8 = dash_detect_utf8();
+  memset(dash, 0, sizeof(dash));
+  /* alternate screen, hide cursor */
+  printf("\033[?1049h\033[?25l");
+  fflush(stdout);
+}
+
+static void dash_end(void) {
+  printf("\033[?25h\033[?1049l");
+  fflush(stdout);
+}
+
+static void dash_bbt(int bp) {
+  printf(" %4d|%d|%d", 1 + (bp/4/metrum), 1 + ((bp/4)%metrum), bp%4);
+}
+
+/**
+ * print jitter history, oldest first, scaled to its maximum
+ * @return maximum of the history [samples]
+ */
+static double dash_sparkline(struct dashstate *d) {
+  static const char *utf8[9] = { " ", "\u2581", "\u2582", "\u2583", "\u2584", "\u2585", "\u2586", "\u2587", "\u2588" };
+  static const char ascii[9] = { ' ', '.', '_', '-', '~', '=', '+', '*', '#' };
+  double max = 0;
+  int i;
+  for (i = 0; i < SPARK_LEN; ++i) {
+    if (d->spark[i] > max) max = d->spark[i];
+  }
+  printf(" ");
+  for (i = 0; i < SPARK_LEN; ++i) {
+    const float v = d->spark[(d->spark_idx + i) % SPARK_LEN];
+    int l = max > 0 ? (int) ceil(8.0 * v / max) : 0;
+    if (l < 0) l = 0;
+    if (l > 8) l = 8;
+    if (dash_utf8) printf("%s", utf8[l]);
+    else printf("%c", ascii[l]);
+  }
+  return max;
+}
+
+/**
+ * render one frame, called at a fixed rate by the main loop
+ */
+static void dash_render(void) {
+  int p, i;
+
+  printf("\033[H");
+  printf("jack_mclk_dump  %.0f Hz  meter %d/4  %.0f fps\033[K\n", samplerate, metrum, refresh_rate);
+
+  if (!transport_check) {
+    printf("jack transport:   not monitored (use -t)");
+  } else if (jt.msg != MSG_TRANSPORT || jt.pos < 0) {
+    printf("jack transport:   no BBT");
+  } else {
+    printf("jack transport:   %s", jt_to_string(jt.pos));
+    dash_bbt((int) floor(jt.tclk / 6.0));
+    if (jt.trate > 0) {
+      printf("  %7.2f[BPM]", jt.trate * 60.0 * samplerate / 24.0);
+    }
+  }
+  printf("\033[K\n\033[K\n");
+
+  printf("port  cur[BPM] flt[BPM]        BBT     events%s  %-*s max[sm]  double  skipped  stopped   no-spp\033[K\n",
+      transport_check ? "  err[clk]" : "", SPARK_LEN, "jitter history");
+
+  for (p = 0; p < nports; ++p) {
+    struct appstate *s = &state[p];
+    struct dashstate *d = &dash[p];
+
+    /* advance history by one frame */
+    d->spark[d->spark_idx] = d->jitter;
+    d->spark_idx = (d->spark_idx + 1) % SPARK_LEN;
+    d->jitter = 0;
+
+    printf("%3d %s", p + 1, d->events == 0 ? " " : (s->rolling ? ">" : "."));
+    if (d->bpm > 0) printf(" %8.2f", d->bpm); else printf("       ??");
+    if (d->flt_bpm > 0) printf(" %8.2f", d->flt_bpm); else printf("       ??");
+    if (s->rolling) {
+      dash_bbt(s->bcnt + s->sequence / 6);
+    } else {
+      printf("   ----|-|-");
+    }
+    printf(" %10llu", (unsigned long long) d->events);
+    if (transport_check) {
+      if (s->phase_clk_stats.n > 0 && jt.pos == JackTransportRolling) {
+	printf("  %+8.2f", s->phase_clk);
+      } else {
+	printf("        ??");
+      }
+    }
+    printf(" ");
+    printf(" %7.1f", dash_sparkline(d));
+    for (i = ANOMALY_NONE + 1; i < ANOMALY_LAST; ++i) {
+      printf(" %*d", i == ANOMALY_DOUBLE_TICK ? 7 : 8, anomaly_total[p][i]);
+    }
+    printf("\033[K\n");
+  }
+  printf("\033[J");
+}
+
+static void print_time_event(struct appstate *s, timenfo *t) {
+  double bpm, flt_bpm;
+
+  if (t->msg == MSG_TRANSPORT) {
+    memcpy(&jt, t, sizeof(timenfo));
+    return;
+  }
+
+  if (t->msg == MSG_CONFIG) {
+    config_changed(t);
+    if (dashboard) {
+      return;
+    }
+    if (out_format == FMT_TEXT) {
+      print_text_config(t);
+    } else {
+      write_record(s, t, 0, 0);
+    }
+    return;
+  }
+
+  if (dashboard) {
+    if (t->msg == MSG_ANOMALY) {
+      if (t->anomaly < ANOMALY_LAST) {
+	anomaly_total[t->port][t->anomaly] = t->pos;
+      }
+      return;
+    }
+    update_tempo(s, t, &bpm, &flt_bpm);
+    update_phase(s, t);
+    update_estimators(s, t);
+    dash_event(s, t, bpm, flt_bpm);
+    advance_sequence(s, t);
+    return;
+  }
+
+  if (t->msg == MSG_ANOMALY || anomalies_only) {
+    /* summaries, or flagged events only: no tempo tracking */
+    if (t->msg == MSG_ANOMALY && t->anomaly < ANOMALY_LAST) {
+      anomaly_total[t->port][t->anomaly] = t->pos;
+      if (t->anomaly != ANOMALY_LAST - 1) return;
+    } else if (t->anomaly == ANOMALY_NONE) {
+      return;
+    }
+    if (out_format == FMT_TEXT) {
+      print_text_anomaly(t);
+    } else if (t->msg == MSG_ANOMALY) {
+      int i;
+      for (i = ANOMALY_NONE + 1; i < ANOMALY_LAST; ++i) {
+	timenfo a;
+	memcpy(&a, t, sizeof(timenfo));
+	a.anomaly = i;
+	a.pos = anomaly_total[t->port][i];
+	write_record(s, &a, 0, 0);
+      }
+    } else {
+      write_record(s, t, 0, 0);
+    }
+    return;
+  }
+
+  update_tempo(s, t, &bpm, &flt_bpm);
+  update_phase(s, t);
+  update_estimators(s, t);
+
+  if (out_format == FMT_TEXT) {
+    if (t->anomaly != ANOMALY_NONE) {
+      print_text_anomaly(t);
+    }
+    print_text_event(s, t, bpm, flt_bpm);
+  } else {
+    write_record(s, t, bpm, flt_bpm);
+  }
+
+  advance_sequence(s, t);
+}
+
+/**
+ * create or re-open the capture file and map it into memory.
+ * An existing file with matching layout is continued.
+ */
+static int capture_open(const char *fn, uint64_t capacity) {
+  const size_t len = sizeof(mclk_capture_header) + capacity * sizeof(timenfo);
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(fn, O_RDWR | O_CREAT, 0644)) < 0) {
+    fprintf(stderr, "cannot open capture file '%s'\n", fn);
+    return -1;
+  }
+  if (fstat(fd, &st) || (st.st_size != (off_t) len && ftruncate(fd, len))) {
+    fprintf(stderr, "cannot resize capture file '%s'\n", fn);
+    close(fd);
+    return -1;
+  }
+#ifdef __linux__
+  /* allocate all blocks now, rather than while capturing */
+  posix_fallocate(fd, 0, len);
+#endif
+  map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "cannot map capture file '%s'\n", fn);
+    return -1;
+  }
+
+  capture = (mclk_capture_header*) map;
+  capture_maplen = len;
+
+  if (memcmp(capture->magic, MCLK_CAPTURE_MAGIC, sizeof(capture->magic))
+      || capture->version != MCLK_CAPTURE_VERSION
+      || capture->record_size != sizeof(timenfo)
+      || capture->capacity != capacity
+      || capture->samplerate != samplerate
+     ) {
+    memset(capture, 0, sizeof(mclk_capture_header));
+    capture->version     = MCLK_CAPTURE_VERSION;
+    capture->record_size = sizeof(timenfo);
+    capture->capacity    = capacity;
+    capture->samplerate  = samplerate;
+    /* magic is written last, readers ignore partially initialized files */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(capture->magic, MCLK_CAPTURE_MAGIC, sizeof(capture->magic));
+  }
+  return 0;
+}
+
+/**
+ * store event in the capture file.
+ * The record is written before the index is published so that
+ * concurrent readers never see incomplete data.
+ */
+static void capture_write(timenfo *t) {
+  timenfo *rec = (timenfo*) (capture + 1);
+  capture->realtime_offset = realtime_offset;
+  const uint64_t widx = capture->write_index;
+  memcpy(&rec[widx % capture->capacity], t, sizeof(timenfo));
+  __atomic_store_n(&capture->write_index, widx + 1, __ATOMIC_RELEASE);
+}
+
+static void capture_close(void) {
+  if (capture) {
+    msync(capture, capture_maplen, MS_ASYNC);
+    munmap(capture, capture_maplen);
+  }
+  capture = NULL;
+}
+
+/**
+ * read a capture file, which may be written to concurrently.
+ * Records are copied first, records that have been overwritten
+ * while copying are skipped.
+ * @param events set to a newly allocated array, to be free()d by the caller
+ * @param n_events set to the number of valid records in events
+ */
+static int read_capture(const char *fn, timenfo **events, size_t *n_events) {
+  const mclk_capture_header *hdr;
+  const timenfo *rec;
+  timenfo *copy;
+  uint64_t cap, w0, w1, first, i;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "cannot open capture file '%s'\n", fn);
+    return -1;
+  }
+  if (st.st_size < (off_t) sizeof(mclk_capture_header)) {
+    fprintf(stderr, "'%s' is not a capture file\n", fn);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "cannot map capture file '%s'\n", fn);
+    return -1;
+  }
+
+  hdr = (const mclk_capture_header*) map;
+  rec = (const timenfo*) (hdr + 1);
+  if (memcmp(hdr->magic, MCLK_CAPTURE_MAGIC, sizeof(hdr->magic))
+      || hdr->version != MCLK_CAPTURE_VERSION
+      || hdr->record_size != sizeof(timenfo)
+      || st.st_size < (off_t) (sizeof(mclk_capture_header) + hdr->capacity * sizeof(timenfo))
+     ) {
+    fprintf(stderr, "'%s' is not a valid capture file\n", fn);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  samplerate = hdr->samplerate;
+  realtime_offset = hdr->realtime_offset;
+  cap = hdr->capacity;
+  w0 = __atomic_load_n(&hdr->write_index, __ATOMIC_ACQUIRE);
+  first = w0 > cap ? w0 - cap : 0;
+
+  copy = (timenfo*) malloc((w0 - first) * sizeof(timenfo) + 1);
+  if (!copy) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  for (i = first; i < w0; ++i) {
+    memcpy(&copy[i - first], &rec[i % cap], sizeof(timenfo));
+  }
+
+  /* discard records that were overwritten by the writer meanwhile.
+   * The writer fills slot w1 % cap before it publishes w1 + 1,
+   * so record w1 - cap may be torn as well. */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  w1 = __atomic_load_n(&hdr->write_index, __ATOMIC_ACQUIRE);
+  munmap(map, st.st_size);
+
+  if (w1 + 1 > cap && w1 + 1 - cap > first) {
+    const uint64_t skip = (w1 + 1 - cap - first) < (w0 - first) ? (w1 + 1 - cap - first) : (w0 - first);
+    memmove(copy, &copy[skip], (w0 - first - skip) * sizeof(timenfo));
+    first += skip;
+  }
+
+  *events = copy;
+  *n_events = w0 - first;
+  return 0;
+}
+
+/**
+ * print all events of a capture file
+ */
+static int replay_capture(const char *fn) {
+  timenfo *events;
+  size_t n_events, i;
+
+  if (read_capture(fn, &events, &n_events)) {
+    return -1;
+  }
+
+  nports = 1;
+  for (i = 0; i < n_events; ++i) {
+    if (events[i].port >= nports && events[i].port < MAX_PORTS) {
+      nports = events[i].port + 1;
+    }
+  }
+
+  write_header();
+  for (i = 0; i < n_events; ++i) {
+    if (events[i].port < MAX_PORTS) {
+      print_time_event(&state[events[i].port], &events[i]);
+    }
+  }
+  fflush(stdout);
+  free(events);
+  return 0;
+}
+
+/**
+ * append a received MIDI message to the Standard MIDI File
+ */
+static void smf_export(timenfo *t) {
+  uint8_t d[3];
+  if (!(t->msg & 0x80)) {
+    return; // internal message
+  }
+  d[0] = t->msg;
+  if (t->msg == 0xf2) {
+    d[1] = t->pos & 0x7f;
+    d[2] = (t->pos >> 7) & 0x7f;
+  }
+  smf_writer_event(smf_out, t->tme, d, t->msg == 0xf2 ? 3 : 1);
+}
+
+/**
+ * block until process() signals new data
+ * or the given timeout (in seconds) expires. 0: no timeout
+ */
+static void wait_for_data(double timeout) {
+  if (timeout > 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += (time_t) floor(timeout);
+    ts.tv_nsec += (long) (1e9 * (timeout - floor(timeout)));
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_nsec -= 1000000000;
+      ts.tv_sec++;
+    }
+    if (sem_timedwait (&data_ready, &ts) != 0) {
+      return; // ETIMEDOUT or EINTR
+    }
+  } else if (sem_wait (&data_ready) != 0) {
+    return; // EINTR
+  }
+  /* coalesce wakeups of cycles that are drained in the next batch */
+  while (sem_trywait (&data_ready) == 0) ;
+}
+
+static double elapsed_since(struct timespec *t0) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t0->tv_sec) + 1e-9 * (now.tv_nsec - t0->tv_nsec);
+}
+
+/* offline analysis */
+
+struct eventlist {
+  timenfo *ev;
+  size_t n;
+  size_t alloc;
+};
+
+static int eventlist_push(struct eventlist *l, timenfo *t) {
+  if (l->n >= l->alloc) {
+    const size_t alloc = l->alloc ? 2 * l->alloc : 65536;
+    timenfo *ev = (timenfo*) realloc(l->ev, alloc * sizeof(timenfo));
+    if (!ev) return -1;
+    l->ev = ev;
+    l->alloc = alloc;
+  }
+  memcpy(&l->ev[l->n++], t, sizeof(timenfo));
+  return 0;
+}
+
+/**
+ * read binary output stream, as written by '-f binary'
+ */
+static int load_stream(const char *fn, struct eventlist *l) {
+  mclk_stream_header h;
+  mclk_record r;
+  FILE *f;
+
+  if (!(f = fopen(fn, "rb"))) {
+    return -1;
+  }
+  if (fread(&h, sizeof(mclk_stream_header), 1, f) != 1
+      || memcmp(h.magic, MCLK_STREAM_MAGIC, sizeof(h.magic))
+      || h.version != MCLK_STREAM_VERSION
+      || h.record_size != sizeof(mclk_record)
+     ) {
+    fprintf(stderr, "'%s' is not a valid binary stream\n", fn);
+    fclose(f);
+    return -1;
+  }
+  samplerate = h.samplerate;
+  while (fread(&r, sizeof(mclk_record), 1, f) == 1) {
+    timenfo t;
+    memset(&t, 0, sizeof(timenfo));
+    t.msg  = r.msg;
+    t.port = r.port;
+    t.anomaly = r.anomaly;
+    t.pos  = r.pos;
+    t.tme  = r.tme;
+    t.usecs = r.usecs;
+    if (eventlist_push(l, &t)) break;
+  }
+  fclose(f);
+  return 0;
+}
+
+static void smf_event(void *arg, int track, uint64_t time, const uint8_t *data, size_t size) {
+  timenfo t;
+  memset(&t, 0, sizeof(timenfo));
+  switch (data[0]) {
+    case 0xf2:
+      if (size < 3) return;
+      t.pos = (data[2] << 7) | data[1];
+      break;
+    case 0xf8:
+    case 0xfa:
+    case 0xfb:
+    case 0xfc:
+      break;
+    default:
+      return;
+  }
+  t.msg  = data[0];
+  t.port = track < MAX_PORTS ? track : MAX_PORTS - 1;
+  t.tme  = time;
+  eventlist_push((struct eventlist*) arg, &t);
+}
+
+/* Vectorizable kernels for the interval and jitter statistics of
+ * analyze_clock(). The tempo estimation before it is per event and scalar.
+ * Reductions use four independent accumulators, so that
+ * the compiler can vectorize them without -ffast-math.
+ */
+
+/** dt[i] = t[i+1] - t[i] */
+static void kernel_interval(const uint64_t *restrict t, double *restrict dt, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    dt[i] = (double) (int64_t) (t[i + 1] - t[i]);
+  }
+}
+
+/** d[i] = x[i+1] - x[i], w[i] = v[i] * v[i+1] */
+static void kernel_diff(const double *restrict x, const double *restrict v, double *restrict d, double *restrict w, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    d[i] = x[i + 1] - x[i];
+    w[i] = v[i] * v[i + 1];
+  }
+}
+
+/** w[i] = 1 if x[i] <= threshold, 0 otherwise */
+static void kernel_mask(const double *restrict x, double *restrict w, double threshold, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    w[i] = x[i] <= threshold ? 1.0 : 0.0;
+  }
+}
+
+struct stats {
+  double n;
+  double mean;
+  double stddev;
+  double rms;
+  double min;
+  double max;
+};
+
+/** weighted statistics of x, w[i] is either 0 or 1 */
+static void kernel_stats(const double *restrict x, const double *restrict w, size_t n, struct stats *st) {
+  double cnt[4] = {0, 0, 0, 0};
+  double sum[4] = {0, 0, 0, 0};
+  double sq[4]  = {0, 0, 0, 0};
+  double sqd[4] = {0, 0, 0, 0};
+  double mn[4] = {INFINITY, INFINITY, INFINITY, INFINITY};
+  double mx[4] = {-INFINITY, -INFINITY, -INFINITY, -INFINITY};
+  size_t i, k;
+
+  const size_t n4 = n & ~3;
+  for (i = 0; i < n4; i += 4) {
+    for (k = 0; k < 4; ++k) {
+      const double v = x[i + k] * w[i + k];
+      cnt[k] += w[i + k];
+      sum[k] += v;
+      sq[k]  += v * v;
+      mn[k] = (w[i + k] > 0 && x[i + k] < mn[k]) ? x[i + k] : mn[k];
+      mx[k] = (w[i + k] > 0 && x[i + k] > mx[k]) ? x[i + k] : mx[k];
+    }
+  }
+  for (; i < n; ++i) {
+    const double v = x[i] * w[i];
+    cnt[0] += w[i];
+    sum[0] += v;
+    sq[0]  += v * v;
+    mn[0] = (w[i] > 0 && x[i] < mn[0]) ? x[i] : mn[0];
+    mx[0] = (w[i] > 0 && x[i] > mx[0]) ? x[i] : mx[0];
+  }
+
+  st->n    = cnt[0] + cnt[1] + cnt[2] + cnt[3];
+  st->mean = st->n > 0 ? (sum[0] + sum[1] + sum[2] + sum[3]) / st->n : 0;
+  st->rms  = st->n > 0 ? sqrt((sq[0] + sq[1] + sq[2] + sq[3]) / st->n) : 0;
+  st->min  = fmin(fmin(mn[0], mn[1]), fmin(mn[2], mn[3]));
+  st->max  = fmax(fmax(mx[0], mx[1]), fmax(mx[2], mx[3]));
+
+  /* 2nd pass: variance, numerically stable for small jitter */
+  for (i = 0; i < n4; i += 4) {
+    for (k = 0; k < 4; ++k) {
+      const double d = (x[i + k] - st->mean) * w[i + k];
+      sqd[k] += d * d;
+    }
+  }
+  for (; i < n; ++i) {
+    const double d = (x[i] - st->mean) * w[i];
+    sqd[0] += d * d;
+  }
+  st->stddev = st->n > 1 ? sqrt((sqd[0] + sqd[1] + sqd[2] + sqd[3]) / (st->n - 1)) : 0;
+}
+
+/**
+ * analyze clock of a single port
+ * @param t times of clock events, n elements
+ */
+static void analyze_clock(int port, const uint64_t *t, size_t n, double flt_min, double flt_max, double flt_last) {
+  struct stats si, sj;
+  double *dt, *w, *dd, *wd;
+
+  printf("port %d: %lu clock events", port + 1, (unsigned long) n);
+  if (n < 3) {
+    printf("\n");
+    return;
+  }
+  printf(", %.1f sec\n", (t[n - 1] - t[0]) / samplerate);
+
+  dt = (double*) malloc((n - 1) * sizeof(double));
+  w  = (double*) malloc((n - 1) * sizeof(double));
+  dd = (double*) malloc((n - 2) * sizeof(double));
+  wd = (double*) malloc((n - 2) * sizeof(double));
+  if (!dt || !w || !dd || !wd) {
+    free(dt); free(w); free(dd); free(wd);
+    return;
+  }
+
+  /* intervals longer than 1 sec (< 2.5 BPM) are gaps (transport stopped) */
+  kernel_interval(t, dt, n - 1);
+  kernel_mask(dt, w, samplerate, n - 1);
+  kernel_diff(dt, w, dd, wd, n - 2);
+  kernel_stats(dt, w, n - 1, &si);
+  kernel_stats(dd, wd, n - 2, &sj);
+
+  if (si.n > 0) {
+    printf("  tempo:    mean %8.3f[BPM] DLL: last %8.3f min %8.3f max %8.3f[BPM]\n",
+	samplerate * 60.0 / (24.0 * si.mean), flt_last, flt_min, flt_max);
+    printf("  interval: mean %8.3f[sm] stddev %7.3f[sm] (%.1f[us]) min %.0f max %.0f[sm]\n",
+	si.mean, si.stddev, 1e6 * si.stddev / samplerate, si.min, si.max);
+  }
+  if (sj.n > 0) {
+    printf("  jitter:   rms %7.3f[sm] (%.1f[us]) max %.0f[sm] (interval difference)\n",
+	sj.rms, 1e6 * sj.rms / samplerate, fmax(fabs(sj.min), fabs(sj.max)));
+  }
+  printf("  gaps:     %.0f (intervals > 1 sec are ignored)\n", (n - 1) - si.n);
+
+  free(dt); free(w); free(dd); free(wd);
+}
+
+/**
+ * analyze a recorded clock stream:
+ * capture file (-o), binary output stream (-f binary) or Standard MIDI File
+ */
+static int analyze_file(const char *fn) {
+  struct eventlist l;
+  struct timespec t0;
+  double dt_est;
+  char magic[8];
+  double flt_min[MAX_PORTS], flt_max[MAX_PORTS], flt_last[MAX_PORTS];
+  struct rtstate anomalies[MAX_PORTS];
+  short have_summary = 0;
+  size_t nclk[MAX_PORTS];
+  uint64_t *clk[MAX_PORTS];
+  size_t i;
+  int p, rv = -1;
+  FILE *f;
+
+  memset(&l, 0, sizeof(struct eventlist));
+  memset(magic, 0, sizeof(magic));
+
+  if (!(f = fopen(fn, "rb"))) {
+    fprintf(stderr, "cannot open '%s'\n", fn);
+    return -1;
+  }
+  if (fread(magic, 1, sizeof(magic), f) < 4) {
+    fclose(f);
+    fprintf(stderr, "cannot read '%s'\n", fn);
+    return -1;
+  }
+  fclose(f);
+
+  if (!memcmp(magic, MCLK_CAPTURE_MAGIC, 8)) {
+    rv = read_capture(fn, &l.ev, &l.n);
+  } else if (!memcmp(magic, MCLK_STREAM_MAGIC, 8)) {
+    rv = load_stream(fn, &l);
+  } else if (!memcmp(magic, "MThd", 4)) {
+    rv = smf_read(fn, samplerate, smf_event, &l);
+  } else {
+    fprintf(stderr, "unknown file format '%s'\n", fn);
+  }
+  if (rv) {
+    free(l.ev);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  /* run the same tempo estimation as the live dump */
+  memset(state, 0, sizeof(state));
+  memset(anomalies, 0, sizeof(anomalies));
+  memset(nclk, 0, sizeof(nclk));
+  for (p = 0; p < MAX_PORTS; ++p) {
+    flt_min[p] = INFINITY;
+    flt_max[p] = flt_last[p] = 0;
+  }
+  memset(&jt, 0, sizeof(timenfo));
+  for (i = 0; i < l.n; ++i) {
+    timenfo *t = &l.ev[i];
+    double bpm, flt_bpm;
+    if (t->msg == MSG_TRANSPORT) {
+      memcpy(&jt, t, sizeof(timenfo));
+      continue;
+    }
+    if (t->msg == MSG_CONFIG) {
+      if (t->pos > 0 && t->pos != samplerate && !have_summary) {
+	for (p = 0; p < MAX_PORTS; ++p) {
+	  anomalies[p].last_clk = 0;
+	  anomalies[p].period = 0;
+	  anomalies[p].outlier = 0;
+	}
+      }
+      config_changed(t);
+      continue;
+    }
+    if (t->port >= MAX_PORTS) continue;
+    if (t->msg == MSG_ANOMALY) {
+      /* recorded with -a: use the realtime classification */
+      if (t->anomaly < ANOMALY_LAST) {
+	anomalies[t->port].seen = 1;
+	anomalies[t->port].count[t->anomaly] = t->pos;
+      }
+      have_summary = 1;
+      continue;
+    }
+    if (!have_summary) {
+      classify_event(&anomalies[t->port], t);
+    }
+    update_tempo(&state[t->port], t, &bpm, &flt_bpm);
+    update_phase(&state[t->port], t);
+    update_estimators(&state[t->port], t);
+    advance_sequence(&state[t->port], t);
+    if (t->msg == 0xf8) {
+      ++nclk[t->port];
+    }
+    if (flt_bpm > 0) {
+      flt_last[t->port] = flt_bpm;
+      if (flt_bpm < flt_min[t->port]) flt_min[t->port] = flt_bpm;
+      if (flt_bpm > flt_max[t->port]) flt_max[t->port] = flt_bpm;
+    }
+  }
+
+  dt_est = elapsed_since(&t0);
+
+  /* collect clock times per port */
+  for (p = 0; p < MAX_PORTS; ++p) {
+    clk[p] = nclk[p] > 0 ? (uint64_t*) malloc(nclk[p] * sizeof(uint64_t)) : NULL;
+    nclk[p] = 0;
+  }
+  for (i = 0; i < l.n; ++i) {
+    const timenfo *t = &l.ev[i];
+    if (t->msg == 0xf8 && t->port < MAX_PORTS && clk[t->port]) {
+      clk[t->port][nclk[t->port]++] = t->tme;
+    }
+  }
+
+  for (p = 0; p < MAX_PORTS; ++p) {
+    if (nclk[p] > 0) {
+      analyze_clock(p, clk[p], nclk[p], flt_min[p], flt_max[p], flt_last[p]);
+    }
+    free(clk[p]);
+  }
+
+  {
+    const double dt = elapsed_since(&t0);
+    fprintf(stderr, "analyzed %lu events in %.3f sec (%.1f M events/sec), tempo estimation %.3f sec, clock statistics %.3f sec\n",
+	(unsigned long) l.n, dt, dt > 0 ? 1e-6 * l.n / dt : 0, dt_est, dt - dt_est);
+  }
+  fflush(stdout);
+  print_phase_stats();
+  print_estimator_stats();
+  print_anomaly_stats(anomalies);
+
+  free(l.ev);
+  return 0;
+}
+
+/* sem_post() is async-signal-safe, unlike pthread_cond_signal()
+ * See http://pubs.opengroup.org/onlinepubs/009695399/functions/sem_post.html
+ */
+static void wearedone(int sig) {
+  fprintf(stderr,"caught signal - shutting down.\n");
+  run=0;
+  sem_post (&data_ready);
+}
 
 
 /**************************
@@ -366,26 +2221,143 @@ static void wearedone(int sig) {
 
 static struct option const long_options[] =
 {
+  {"analyze", required_argument, 0, 'A'},
+  {"anomalies", no_argument, 0, 'a'},
   {"bandwidth", required_argument, 0, 'b'},
+  {"capture", required_argument, 0, 'o'},
+  {"capture-size", required_argument, 0, 'C'},
+  {"dashboard", no_argument, 0, 'D'},
+  {"estimator", required_argument, 0, 'E'},
+  {"format", required_argument, 0, 'f'},
+  {"flush-interval", required_argument, 0, 'F'},
   {"help", no_argument, 0, 'h'},
+  {"meter", required_argument, 0, 'm'},
+  {"midi-file", required_argument, 0, 'M'},
   {"newline", no_argument, 0, 'n'},
+  {"ports", required_argument, 0, 'p'},
+  {"ppqn", required_argument, 0, 'Q'},
+  {"quiet", no_argument, 0, 'q'},
+  {"refresh-rate", required_argument, 0, 'R'},
+  {"replay", required_argument, 0, 'r'},
+  {"samplerate", required_argument, 0, 's'},
+  {"summary-interval", required_argument, 0, 'S'},
+  {"transport", no_argument, 0, 't'},
   {"version", no_argument, 0, 'V'},
+  {"wallclock", no_argument, 0, 'w'},
   {NULL, 0, NULL, 0}
 };
 
 static void usage (int status) {
   printf ("jack_mclk_dump - JACK MIDI Clock dump.\n\n");
-  printf ("Usage: jack_mclk_dump [ OPTIONS ] [JACK-port]\n\n");
+  printf ("Usage: jack_mclk_dump [ OPTIONS ] [JACK-port]*\n\n");
   printf ("Options:\n\
+  -a, --anomalies            only print clock anomalies and summaries\n\
+  -A, --analyze <file>       print statistics of a recorded clock stream\n\
+                             and exit\n\
   -b, --bandwidth <1/Hz>     DLL bandwidth in 1/Hz (default: 6.0)\n\
+  -C, --capture-size <num>   number of events kept in the capture file\n\
+                             (default: 4194304)\n\
+  -D, --dashboard            full-screen display of all ports\n\
+  -E, --estimator <spec>     run an additional tempo estimator, can be given\n\
+                             multiple times (see below)\n\
+  -f, --format <fmt>         output format: text, csv, json or binary\n\
+                             (default: text)\n\
+  -F, --flush-interval <sec> flush machine-readable output every <sec>\n\
+                             seconds (default: 1.0)\n\
   -h, --help                 display this help and exit\n\
+  -m, --meter <num>          beats per bar, used to display BBT (default: 4)\n\
+  -M, --midi-file <file>     write received events to a Standard MIDI File\n\
   -n, --newline              print a newline after each Tick\n\
+  -o, --capture <file>       record all events to a circular capture file\n\
+  -p, --ports <num>          number of input ports to register (default: 1)\n\
+  -q, --quiet                do not print events to stdout\n\
+  -Q, --ppqn <num>           resolution of the MIDI file (default: 960)\n\
+  -r, --replay <file>        print the events of a capture file and exit\n\
+  -R, --refresh-rate <fps>   dashboard frames per second (default: 10)\n\
+  -s, --samplerate <Hz>      sample-rate used to analyze MIDI files\n\
+                             (default: 48000)\n\
+  -S, --summary-interval <sec>\n\
+                             report anomaly counters every <sec> seconds,\n\
+                             0 to disable (default: 10, dashboard: 1)\n\
+  -t, --transport            compare received clock to local jack transport\n\
   -V, --version              print version information and exit\n\
+  -w, --wallclock            print wallclock time of events (text format)\n\
 \n");
   printf ("\n\
 This tool subscribes to a JACK Midi Port and prints received Midi\n\
 beat clock and BPM to stdout.\n\
 \n\
+The csv and json (JSON Lines) formats print one event per line. The binary\n\
+format writes a header followed by fixed-size records (sample-time, message,\n\
+port, song-position, current and filtered BPM) in host byte order.\n\
+Machine-readable output is collected in a large buffer and only written\n\
+periodically, text output is flushed for every jack cycle.\n\
+\n\
+A capture file has a fixed size and holds the most recent events. It is\n\
+memory-mapped and can be replayed with -r while it is being recorded.\n\
+Replay uses the selected output format.\n\
+\n\
+Analysis (-A) reads a capture file, a binary output stream (-f binary) or a\n\
+Standard MIDI File, runs the same tempo estimation as the live dump (event\n\
+by event) and prints tempo, interval and jitter statistics for every port\n\
+(MIDI track). Only these statistics are computed in vectorized passes over\n\
+the clock times.\n\
+\n\
+With -t the jack transport position is sampled once per cycle in realtime\n\
+context and passed along with the received events. The phase error of the\n\
+received clock relative to jack transport (in MIDI clocks and samples) is\n\
+printed for every clock and summarized on exit. This is useful to validate\n\
+jack_midi_clock against its timecode master.\n\
+\n\
+Events are timestamped with jack's frame time (shared by all jack clients)\n\
+and converted to jack time (microseconds) using jack's cycle timing.\n\
+Machine-readable formats include both, as well as the corresponding realtime\n\
+clock (wallclock) in microseconds since the epoch.\n\
+\n\
+With -M all received events are written to a Standard MIDI File (type 0).\n\
+Event times are relative to the first event. Clock ticks are placed on the\n\
+file's beat grid and the tempo follows the received clock. Every event is\n\
+on the MIDI tick nearest to its time. Events of all ports are merged\n\
+into a single track. The file is written by the reader thread and\n\
+finalized on exit, -A can be used to analyze it.\n\
+\n\
+Tempo estimators given with -E run side by side on the same events,\n\
+their estimates are printed with every clock and their convergence time\n\
+and noise after convergence are summarized on exit (and by -A):\n\
+  dll[:<1/Hz>]      delay-locked loop with given bandwidth (default: 6.0)\n\
+  kalman[:<ms>]     Kalman filter on phase and period, with given\n\
+                    measurement jitter (default: 0.5)\n\
+  lsq[:<clocks>]    least-squares fit over a sliding window (default: 96)\n\
+e.g. -E dll:1 -E dll:20 -E kalman -E lsq:24\n\
+\n\
+Clock anomalies are detected in realtime context for every received event:\n\
+  double-tick       clock earlier than half the expected period\n\
+  skipped-tick      clock later than 1.5 periods, counted per missing tick\n\
+  clock-stopped     clock after stop (only the first one is flagged)\n\
+  continue-no-spp   continue without a prior song position pointer\n\
+The expected period is a running average of the received clock. An abrupt\n\
+tempo change by more than 50%% is flagged once, then re-learned.\n\
+Flagged events are printed along with the regular output, counters are\n\
+reported periodically and on exit. With -a only flagged events and\n\
+summaries are passed on by the realtime thread, independent of the\n\
+clock rate (unless -M or -o is given, which record all events).\n\
+\n\
+The dashboard (-D) shows current and filtered tempo, BBT, event count,\n\
+a history of the clock jitter (maximum interval difference per frame) and\n\
+anomaly counters of every port, as well as the jack transport state (-t).\n\
+It is redrawn at a fixed rate, independent of the received event rate.\n\
+\n\
+Sample-rate and buffer-size changes of jackd are reported as 'config'\n\
+record (pos: sample-rate). Tempo tracking and anomaly detection restart\n\
+with the next clock after a sample-rate change.\n\
+\n\
+If more than one port is used, the ports given on the command line are\n\
+connected in order: the first to mclk_in_1, the second to mclk_in_2 etc.\n\
+Each one is a port name or alias, a glob pattern if it contains '*', '?'\n\
+or '[' (e.g. 'a2j:*') or an extended regular expression prefixed with\n\
+'re:'. Ports that match later on (e.g. a USB MIDI interface that is\n\
+plugged in again) are connected when they appear.\n\
+\n\
 See also: jack_midi_clock(1)\n\
 \n");
   printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
@@ -398,10 +2370,29 @@ static int decode_switches (int argc, char **argv) {
   int c;
 
   while ((c = getopt_long (argc, argv,
+	 "a"  /* anomalies */
+	 "A:" /* analyze */
 	 "b:" /* bandwidth */
+	 "C:" /* capture-size */
+	 "D"  /* dashboard */
+	 "E:" /* estimator */
+	 "f:" /* format */
+	 "F:" /* flush-interval */
 	 "h"  /* help */
+	 "m:" /* meter */
+	 "M:" /* midi-file */
 	 "n"  /* newline */
-	 "V", /* version */
+	 "o:" /* capture */
+	 "p:" /* ports */
+	 "q"  /* quiet */
+	 "Q:" /* ppqn */
+	 "r:" /* replay */
+	 "R:" /* refresh-rate */
+	 "s:" /* samplerate */
+	 "S:" /* summary-interval */
+	 "t"  /* transport */
+	 "V"  /* version */
+	 "w", /* wallclock */
 	 long_options, (int *) 0)) != EOF) {
     switch (c) {
       case 'b':
@@ -411,9 +2402,107 @@ static int decode_switches (int argc, char **argv) {
 	  dll_bandwidth = 6.0;
 	}
 	break;
+      case 'a':
+	anomalies_only = 1;
+	break;
+      case 'A':
+	analyze_file_name = optarg;
+	break;
+      case 'C':
+	capture_size = strtoull(optarg, NULL, 10);
+	if (capture_size < 1024 || capture_size > (1ULL << 32)) {
+	  fprintf(stderr, "Invalid capture-size, should be 1024 <= num <= 2^32. Using 2^22\n");
+	  capture_size = 1 << 22;
+	}
+	break;
+      case 'D':
+	dashboard = 1;
+	break;
+      case 'E':
+	if (add_estimator(optarg)) {
+	  exit (EXIT_FAILURE);
+	}
+	break;
+      case 'f':
+	if (!strcmp(optarg, "text")) out_format = FMT_TEXT;
+	else if (!strcmp(optarg, "csv")) out_format = FMT_CSV;
+	else if (!strcmp(optarg, "json")) out_format = FMT_JSON;
+	else if (!strcmp(optarg, "binary")) out_format = FMT_BINARY;
+	else {
+	  fprintf(stderr, "Invalid format '%s', should be one of text, csv, json, binary.\n", optarg);
+	  exit (EXIT_FAILURE);
+	}
+	break;
+      case 'F':
+	flush_interval = atof(optarg);
+	if (flush_interval < 0.0 || flush_interval > 60.0) {
+	  fprintf(stderr, "Invalid flush-interval, should be 0 <= sec <= 60.0. Using 1.0sec\n");
+	  flush_interval = 1.0;
+	}
+	break;
+      case 'm':
+	metrum = atoi(optarg);
+	if (metrum < 1 || metrum > 64) {
+	  fprintf(stderr, "Invalid meter, should be 1 <= beats <= 64. Using 4.\n");
+	  metrum = 4;
+	}
+	break;
+      case 'M':
+	smf_file = optarg;
+	break;
       case 'n':
 	newline = '\n';
 	break;
+      case 'o':
+	capture_file = optarg;
+	break;
+      case 'q':
+	quiet = 1;
+	break;
+      case 'Q':
+	smf_ppqn = atoi(optarg);
+	if (smf_ppqn < 24 || smf_ppqn > 32767) {
+	  fprintf(stderr, "Invalid ppqn, should be 24 <= ppqn <= 32767. Using 960.\n");
+	  smf_ppqn = 960;
+	}
+	break;
+      case 'r':
+	replay_file = optarg;
+	break;
+      case 'R':
+	refresh_rate = atof(optarg);
+	if (refresh_rate < 1.0 || refresh_rate > 60.0) {
+	  fprintf(stderr, "Invalid refresh-rate, should be 1 <= fps <= 60. Using 10.\n");
+	  refresh_rate = 10.0;
+	}
+	break;
+      case 't':
+	transport_check = 1;
+	break;
+      case 's':
+	samplerate = atof(optarg);
+	if (samplerate < 8000 || samplerate > 768000) {
+	  fprintf(stderr, "Invalid samplerate, should be 8000 <= Hz <= 768000. Using 48000\n");
+	  samplerate = 48000;
+	}
+	break;
+      case 'S':
+	summary_interval = atof(optarg);
+	if (summary_interval < 0.0 || summary_interval > 3600.0) {
+	  fprintf(stderr, "Invalid summary-interval, should be 0 <= sec <= 3600. Using 10sec\n");
+	  summary_interval = 10.0;
+	}
+	break;
+      case 'p':
+	nports = atoi(optarg);
+	if (nports < 1 || nports > MAX_PORTS) {
+	  fprintf(stderr, "Invalid number of ports, should be 1 <= n <= %d. Using 1.\n", MAX_PORTS);
+	  nports = 1;
+	}
+	break;
+      case 'w':
+	show_wallclock = 1;
+	break;
       case 'V':
 	printf ("jack_mclk_dump version %s\n\n", VERSION);
 	printf ("Copyright (C) GPL 2013 Robin Gareus <robin@gareus.org>\n");
@@ -426,58 +2515,176 @@ static int decode_switches (int argc, char **argv) {
 	usage (EXIT_FAILURE);
     }
   }
+  if (summary_interval < 0) {
+    summary_interval = dashboard ? 1.0 : 10.0;
+  }
   return optind;
 }
 
 int main (int argc, char ** argv) {
+  timenfo batch[RBSIZE];
+  struct timespec last_flush, last_offset, last_frame;
   int i;
 
   decode_switches (argc, argv);
 
+  if (out_format == FMT_BINARY && isatty(fileno(stdout))) {
+    fprintf(stderr, "Refusing to write binary data to a terminal.\n");
+    return 1;
+  }
+
+  if (dashboard && !analyze_file_name && !replay_file) {
+    if (out_format != FMT_TEXT || quiet || anomalies_only) {
+      fprintf(stderr, "The dashboard can not be combined with -a, -f or -q.\n");
+      return 1;
+    }
+    if (!isatty(fileno(stdout))) {
+      fprintf(stderr, "The dashboard requires a terminal.\n");
+      return 1;
+    }
+  }
+
+  if (out_format != FMT_TEXT || dashboard) {
+    /* large user-space buffer, flushed on a timer or per frame.
+     * static: stdio uses it until exit() flushes stdout */
+    static char outbuf[OUTBUF_SIZE];
+    setvbuf(stdout, outbuf, _IOFBF, OUTBUF_SIZE);
+  }
+
+  if (analyze_file_name) {
+    return analyze_file(analyze_file_name) ? 1 : 0;
+  }
+
+  if (replay_file) {
+    memset(state, 0, sizeof(state));
+    return replay_capture(replay_file) ? 1 : 0;
+  }
+
+  sem_init (&data_ready, 0, 0);
+
   if (init_jack("jack_mclk_dump"))
     goto out;
   if (jack_portsetup())
     goto out;
+  if (port_rules_setup(argc, argv))
+    goto out;
 
   rb = jack_ringbuffer_create(RBSIZE * sizeof(timenfo));
 
+  if (capture_file && capture_open(capture_file, capture_size)) {
+    goto out;
+  }
+
+  if (smf_file && !(smf_out = smf_writer_open(smf_file, samplerate, smf_ppqn))) {
+    fprintf(stderr, "cannot create MIDI file '%s'\n", smf_file);
+    goto out;
+  }
+
   if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
     fprintf(stderr, "Warning: Can not lock memory.\n");
   }
+  if (capture) {
+    /* the capture file is only accessed by the (non realtime) reader */
+    munlock(capture, capture_maplen);
+  }
 
   if (jack_activate (j_client)) {
     fprintf (stderr, "cannot activate client.\n");
     goto out;
   }
 
-  while (optind < argc)
-    port_connect(argv[optind++]);
+  if (port_rules) {
+    autoconnect_scan(port_rules);
+  }
 
 #ifndef _WIN32
   signal(SIGHUP, wearedone);
   signal(SIGINT, wearedone);
 #endif
 
-  memset(&state, 0, sizeof(struct appstate));
-  pthread_mutex_lock (&msg_thread_lock);
+  memset(state, 0, sizeof(state));
+  update_realtime_offset();
+  write_header();
+  clock_gettime(CLOCK_MONOTONIC, &last_flush);
+  last_offset = last_frame = last_flush;
+  if (dashboard) {
+    dash_start();
+  }
 
   /* all systems go */
 
   while (run && j_client) {
-    const int mqlen = jack_ringbuffer_read_space (rb) / sizeof(timenfo);
+    /* follow NTP adjustments of the realtime clock */
+    if (elapsed_since(&last_offset) >= 1.0) {
+      update_realtime_offset();
+      clock_gettime(CLOCK_MONOTONIC, &last_offset);
+    }
+
+    /* drain pending Mclk events in one batch.
+     * jack rounds the ringbuffer size up to a power of two */
+    int mqlen = jack_ringbuffer_read_space (rb) / sizeof(timenfo);
+    if (mqlen > RBSIZE) mqlen = RBSIZE;
+    jack_ringbuffer_read(rb, (char*) batch, mqlen * sizeof(timenfo));
     for (i=0; i < mqlen; ++i) {
-      /* process Mclk event */
-      timenfo t;
-      jack_ringbuffer_read(rb, (char*) &t, sizeof(timenfo));
-      print_time_event(&state, &t);
+      if (capture) {
+	capture_write(&batch[i]);
+      }
+      if (smf_out) {
+	smf_export(&batch[i]);
+      }
+      if (!quiet) {
+	print_time_event(&state[batch[i].port], &batch[i]);
+      }
+    }
+
+    if (mqlen == RBSIZE && jack_ringbuffer_read_space (rb) >= sizeof(timenfo)) {
+      continue;
+    }
+
+    if (port_rules) {
+      autoconnect_poll(port_rules);
+    }
+
+    if (dashboard) {
+      double dt = elapsed_since(&last_frame);
+      if (dt >= 1.0 / refresh_rate) {
+	dash_render();
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &last_frame);
+	dt = 0;
+      }
+      wait_for_data(fmax(1.0 / refresh_rate - dt, 1e-3));
+    } else if (out_format == FMT_TEXT) {
+      fflush(stdout);
+      wait_for_data(0);
+    } else {
+      if (elapsed_since(&last_flush) >= flush_interval) {
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &last_flush);
+      }
+      wait_for_data(flush_interval > 0 ? flush_interval : 0);
     }
-    fflush(stdout);
-    pthread_cond_wait (&data_ready, &msg_thread_lock);
   }
-  pthread_mutex_unlock (&msg_thread_lock);
+  if (dashboard) {
+    dash_end();
+  }
+  fflush(stdout);
+  print_phase_stats();
+  print_estimator_stats();
+
+  /* stop the process thread, anomaly counters are final */
+  if (j_client) {
+    jack_deactivate (j_client);
+  }
+  print_anomaly_stats(rtstate);
 
 out:
   cleanup();
+  autoconnect_free(port_rules);
+  capture_close();
+  if (smf_out && smf_writer_close(smf_out)) {
+    fprintf(stderr, "error writing MIDI file '%s'\n", smf_file);
+  }
   return 0;
 }
 /* vi:set ts=8 sts=2 sw=2: */
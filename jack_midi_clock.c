@@ -20,17 +20,32 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <math.h>
 #include <getopt.h>
 
 #include <jack/jack.h>
 #include <jack/midiport.h>
+#include <jack/ringbuffer.h>
 
 #include <sys/mman.h>
 
 #ifndef WIN32
 #include <signal.h>
+#include <poll.h>
+#endif
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "smf.h"
+#include "tempomap.h"
+#include "autoconnect.h"
+#include "rtpmidi.h"
+
+#ifdef WITH_LINK
+#include <abl_link.h>
 #endif
 
 /* bitwise flags -- used w/ msg_filter */
@@ -39,6 +54,13 @@ enum {
   MSG_NO_POSITION   = 2  /**< do not send absolute song position */
 };
 
+/* what to send while jack is freewheeling */
+enum {
+  FW_RUN = 0, /**< keep sending at transport rate */
+  FW_MUTE,    /**< send nothing */
+  FW_STOP     /**< stop and song-position on entry, continue on exit */
+};
+
 /* jack_position_t - excerpt */
 struct bbtpos {
   jack_position_bits_t valid;  /**< which other fields are valid */
@@ -48,16 +70,96 @@ struct bbtpos {
   double    bar_start_tick; /**< number of ticks that have elapsed between frame 0 and the first beat of the current measure. */
 };
 
+/* what to send for song positions beyond the 14 bit range of SPP */
+enum {
+  LP_OFF = 0, /**< nothing */
+  LP_MTC,     /**< MTC full-frame message */
+  LP_MMC      /**< MMC locate command */
+};
+
+#define MAX_EVENT_SIZE (13) ///< MMC locate
+
+/* sent MIDI event, passed to the MIDI file writer */
+typedef struct {
+  uint64_t time;    ///< jack frame time
+  uint8_t  size;
+  uint8_t  data[MAX_EVENT_SIZE];
+} midi_record;
+
+#define SMF_RBSIZE (8192) ///< records, several seconds of clock
+
+#define MAX_OUTPUTS (16)
+#define OUTPUT(p) (1u << (p))
+#define ALL_OUTPUTS (0xffff)
+
+#define PHASE_SLEW (0.01) ///< max phase correction per frame when re-locking to the timecode master
+#define TEMPO_STEP (0.05) ///< relative tempo change that bypasses the tempo filter
+#define DIN_BAUD (31250.0) ///< DIN-MIDI link rate, 10 bits per byte
+#define LINK_QUANTUM (4.0) ///< beats per Ableton Link phase cycle, a 4/4 bar
+#define LINK_TICKS_PER_BEAT (1e6) ///< BBT resolution of positions taken from Link
+
+/* events of one cycle, emitted in time order after generate() */
+#define MAX_CYCLE_EVENTS (256)
+
+/* Ableton Link session, see -k */
+enum {
+  LINK_OFF = 0,
+  LINK_FOLLOW, /**< the Link session is the tempo source */
+  LINK_PUBLISH /**< the transport tempo is published to the session */
+};
+
+/* event priorities, low priority events are dropped first if the
+ * port buffer is short on space */
+enum {
+  PRIO_CLOCK = 0,
+  PRIO_POSITION,
+  PRIO_TRANSPORT,
+  PRIO_LAST
+};
+
+typedef struct {
+  jack_nframes_t time;
+  uint16_t       outputs; ///< bitmask of output ports, OUTPUT(n)
+  uint8_t        prio;
+  uint8_t        size;
+  uint8_t        data[MAX_EVENT_SIZE];
+} cycle_event;
+
+/* per-configuration constants, triple buffered: the sample-rate and
+ * buffer-size callbacks fill the back slot and swap it with the pending one,
+ * process() takes the pending slot at the start of a cycle. The callbacks
+ * may run back to back, but never write the slot process() is reading. */
+typedef struct {
+  double         samplerate;
+  jack_nframes_t buffer_size;
+  double         clk_per_qnpm; ///< samples per MIDI clock at 1 quarter-note per minute
+  double         din_byte;     ///< samples per byte on a DIN-MIDI link
+} clock_config;
+
 /* jack connection */
-static jack_port_t            *mclk_output_port = NULL;
+static jack_port_t            *mclk_output_port[MAX_OUTPUTS];
+static autoconnect             *port_rules = NULL;
+static rtpmidi                 *rtp_out = NULL;
 static jack_client_t          *j_client = NULL;
 
 /* application state */
 static jack_transport_state_t  m_xstate = JackTransportStopped;
 static double                  mclk_last_tick = 0.0;
 static int64_t                 song_position_sync = -1;
+static uint16_t                sync_outputs = ALL_OUTPUTS; /**< outputs that wait for song_position_sync */
+static volatile short          join_request[MAX_OUTPUTS]; /**< set by the port-connect callback */
+static int64_t                 join_sync[MAX_OUTPUTS];    /**< per port 'continue' sync point, 0: none */
 static struct bbtpos           last_xpos; /** keep track of transport locates */
 
+/* configuration */
+#define CFG_PENDING (4) ///< flag: the pending slot was not taken yet
+static clock_config            clock_cfg[3];
+static clock_config            clock_cfg_set;          /**< latest configuration, callback side */
+static int                     clock_cfg_back = 0;     /**< callback side */
+static int                     clock_cfg_pending = 1;  /**< shared, | CFG_PENDING */
+static int                     clock_cfg_front = 2;    /**< process() side */
+static const clock_config     *clock_cfg_cur = NULL;   /**< configuration of the current cycle */
+
 static volatile enum {
   Init,
   Run,
@@ -66,12 +168,121 @@ static volatile enum {
 static int wake_main_read = -1;
 static int wake_main_write = -1;
 
+/* Standard MIDI File export */
+static jack_ringbuffer_t      *smf_rb = NULL;
+static smf_writer             *smf_out = NULL;
+static pthread_t               smf_thread;
+static sem_t                   smf_ready;        /**< posted by process() after queueing events */
+static short                   smf_queued = 0;   /**< events were queued this cycle (process thread) */
+static volatile short          smf_thread_run = 0;
+static uint64_t                cycle_frames = 0; /**< jack frame time of current cycle, 64bit */
+
+/* freewheeling */
+static volatile short          freewheeling = 0; /**< set by the freewheel callback */
+static volatile short          fw_ended = 0;     /**< freewheeling ended, report pending */
+static short                   fw_active = 0;    /**< freewheel state process() acts upon */
+static short                   output_muted = 0;
+
+/* flywheel: keep clocking through timecode master dropouts */
+static struct {
+  double   bpm;        ///< last tempo of the timecode master
+  double   beat_type;
+  double   phase;      ///< last offset of the clock from the master's beat grid [frames]
+  short    valid;      ///< bpm and phase are valid
+  short    active;     ///< BBT is missing
+  short    expired;    ///< hold time exceeded
+  short    relock;     ///< BBT is back, slew the phase
+  uint64_t lost;       ///< length of the current dropout [frames]
+} flywheel;
+
+/* tempo filter for jittery timecode masters */
+static struct {
+  double bpm;    ///< filtered tempo
+  double vel;    ///< rate of change [BPM/sec]
+  double phase;  ///< offset of the clock from the master's beat grid to keep [frames]
+  short  valid;  ///< bpm is valid
+  short  locked; ///< phase is valid
+} tempo_filter;
+
+/* dropout statistics, written by process(), reported by the main thread */
+static struct {
+  uint32_t count;   ///< dropouts that ended
+  uint32_t expired; ///< dropouts longer than the hold time
+  uint64_t last;    ///< length of the last dropout [frames]
+  uint64_t longest;
+} fly_stats;
+
+/* song-position rate limit while stopped, see -t */
+static struct {
+  int64_t  wait;    ///< frames until the next song-position may be sent
+  short    pending; ///< the transport was located, position not sent yet
+  uint32_t burst;   ///< positions coalesced since the limit was last idle
+} spp_limit;
+
+/* song-position statistics, written by process(), reported by the main thread */
+static struct {
+  uint32_t sent;      ///< positions sent while stopped
+  uint32_t coalesced; ///< positions superseded before they were sent
+  uint32_t bursts;    ///< locate bursts that ended with coalesced positions
+  uint32_t last;      ///< positions coalesced in the last burst
+} spp_stats;
+
+/* freewheel statistics, written by process(), reported by the main thread */
+static struct {
+  uint64_t        cycles;
+  uint64_t        frames;
+  double          dsp_sum; ///< seconds spent generating
+  double          dsp_max;
+  struct timespec t0, t1;  ///< start of the first and end of the last cycle
+  volatile short  done;
+} fw_stats;
+
+/* pending events of the current cycle */
+static cycle_event             cycle_ev[MAX_CYCLE_EVENTS];
+static int                     n_cycle_ev = 0;
+static uint32_t                dropped[PRIO_LAST]; /**< written by process(), read by main */
+
+/* DIN-MIDI link model, see -D */
+static double                  din_busy[MAX_OUTPUTS]; /**< frames the link is busy after the end of the last cycle */
+
+/* clock ticks that went on a DIN-MIDI link late, written by process(), reported by the main thread */
+static struct {
+  uint32_t delayed;
+  uint32_t max_delay; ///< [usec]
+} din_stats[MAX_OUTPUTS];
+
+/* tempo map of the timebase master, see -m */
+static tempomap                timebase_map;
+
+/* event output, replaced for offline rendering */
+static jack_midi_data_t* (*midi_event_reserve) (void *port_buffer, jack_nframes_t time, size_t data_size) = jack_midi_event_reserve;
+static void (*midi_clear_buffer) (void *port_buffer) = jack_midi_clear_buffer;
+
 /* commandline options */
 static double   user_bpm   = 0.0;
 static short    force_bpm  = 0;
 static short    tempo_is_qnpm = 1;  /** tempo is quarter notes per minute instead of BPM */
 static short    msg_filter = 0;     /** bitwise flags, MSG_NO_.. */
 static double   resync_delay = 2.0; /**< seconds between 'pos' and 'continue' message */
+static double   spp_settle = 0;     /**< min. seconds between song-positions while stopped, 0: off */
+static char    *smf_file = NULL;
+static int      smf_ppqn = 960;
+static char    *render_file = NULL;
+static char    *timebase_file = NULL; /**< tempo map to act as timebase master with */
+static char    *rtp_peer = NULL;    /**< RTP-MIDI receiver, host[:port] */
+static double   render_rate = 48000.0;
+static jack_nframes_t render_period = 1024;
+static short    fw_policy = FW_RUN;
+static int      n_outputs = 1;
+static uint16_t seamless_outputs = 0; /**< outputs that relocate without stop while rolling */
+static uint16_t din_outputs = 0;    /**< outputs that are sent over a DIN-MIDI link */
+static double   hold_time = 0;      /**< flywheel: seconds to continue without timecode master */
+static double   smooth_time = 0;    /**< tempo filter time constant, 0: off */
+static double   smooth_deadband = 0.1; /**< tempo filter: BPM changes to ignore */
+static short    long_pos = LP_OFF;  /**< LP_*, song positions beyond SPP */
+static short    link_mode = LINK_OFF; /**< LINK_* */
+static int      tc_rate = 1;        /**< index into tc_fps */
+static const int tc_fps[] = { 24, 25, 30 };
 
 #ifdef WITH_JITTER
 static double   jitter_level = 0.0;
@@ -92,6 +303,11 @@ static float randf() {
 
 #endif
 
+#ifdef WITH_LINK
+static abl_link                link_session;
+static abl_link_session_state  link_state; /**< captured and committed by process() */
+#endif
+
 /* MIDI System Real-Time Messages
  * https://en.wikipedia.org/wiki/MIDI_beat_clock
  * http://www.midi.org/techspecs/midimessages.php
@@ -129,15 +345,18 @@ static void wake_main_now(void)
 
 /**
  * Wait for wake signal
- * This blocks until either a signal is received or a wake
- * message is received on the pipe.
+ * This blocks until either a signal is received, a wake
+ * message is received on the pipe or a second passed.
  */
 static void wake_main_wait(void)
 {
 #ifndef WIN32
   if (wake_main_read != -1) {
+	  struct pollfd pfd = { wake_main_read, POLLIN, 0 };
 	  char c = 0;
-	  (void) read(wake_main_read, &c, sizeof(c));
+	  if (poll(&pfd, 1, 1000) > 0) {
+	    (void) read(wake_main_read, &c, sizeof(c));
+	  }
   } else {
     /* fall back on using sleep if pipe fd is invalid */
     sleep(1);
@@ -147,6 +366,75 @@ static void wake_main_wait(void)
 #endif
 }
 
+/**
+ * queue a sent event for the MIDI file writer, realtime safe
+ */
+static void smf_record(jack_nframes_t time, const uint8_t *data, size_t size) {
+  midi_record r;
+  if (!smf_rb || jack_ringbuffer_write_space(smf_rb) < sizeof(midi_record)) {
+    return;
+  }
+  r.time = cycle_frames + time;
+  r.size = size;
+  memcpy(r.data, data, size);
+  jack_ringbuffer_write(smf_rb, (void *) &r, sizeof(midi_record));
+  smf_queued = 1;
+}
+
+/**
+ * MIDI file writer thread, drains the ringbuffer filled by process()
+ */
+static void *smf_writer_thread(void *arg) {
+  midi_record r;
+  while (1) {
+    const short done = !smf_thread_run;
+    while (jack_ringbuffer_read_space(smf_rb) >= sizeof(midi_record)) {
+      jack_ringbuffer_read(smf_rb, (char*) &r, sizeof(midi_record));
+      smf_writer_event(smf_out, r.time, r.data, r.size);
+    }
+    if (done) break;
+    sem_wait(&smf_ready);
+  }
+  return NULL;
+}
+
+static int smf_open(void) {
+  if (!(smf_out = smf_writer_open(smf_file, jack_get_sample_rate(j_client), smf_ppqn))) {
+    fprintf(stderr, "cannot create MIDI file '%s'\n", smf_file);
+    return -1;
+  }
+  smf_rb = jack_ringbuffer_create(SMF_RBSIZE * sizeof(midi_record));
+  sem_init(&smf_ready, 0, 0);
+  smf_thread_run = 1;
+  if (!smf_rb || pthread_create(&smf_thread, NULL, smf_writer_thread, NULL)) {
+    fprintf(stderr, "cannot start MIDI file writer\n");
+    smf_thread_run = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * stop the writer and finalize the file,
+ * call after the jack client was closed
+ */
+static void smf_close(void) {
+  if (smf_thread_run) {
+    smf_thread_run = 0;
+    sem_post(&smf_ready);
+    pthread_join(smf_thread, NULL);
+  }
+  if (smf_out && smf_writer_close(smf_out)) {
+    fprintf(stderr, "error writing MIDI file '%s'\n", smf_file);
+  }
+  if (smf_rb) {
+    jack_ringbuffer_free(smf_rb);
+    sem_destroy(&smf_ready);
+  }
+  smf_out = NULL;
+  smf_rb = NULL;
+}
+
 /**
  * cleanup and exit
  * call this function only _after_ everything has been initialized!
@@ -216,80 +504,609 @@ static const int64_t calc_song_pos(jack_position_t *xpos, int off) {
   return pos;
 }
 
-static const int64_t send_pos_message(void* port_buf, jack_position_t *xpos, int off) {
-  if (msg_filter & MSG_NO_POSITION) return -1;
-  uint8_t *buffer;
-  const int64_t bcnt = calc_song_pos(xpos, off);
+/**
+ * song position in MIDI beats, not rounded
+ */
+static double song_beats(jack_position_t *xpos) {
+  /* 4 MIDI-beats per quarter note (jack beat) */
+  return 4.0 * ((xpos->bar - 1) * xpos->beats_per_bar + (xpos->beat - 1) + xpos->tick / xpos->ticks_per_beat);
+}
 
-  /* send '0xf2' Song Position Pointer.
-   * This is an internal 14 bit register that holds the number of
-   * MIDI beats (1 beat = six MIDI clocks) since the start of the song.
-   */
-  if (bcnt < 0 || bcnt >= 16384) {
-    return -1;
+/**
+ * add an event to the current cycle, keeping time order.
+ * If the queue is full, the latest event of the lowest priority is
+ * dropped to make room, or the new one if none has a lower priority.
+ */
+static void queue_event(uint16_t outputs, jack_nframes_t time, int prio, const uint8_t *data, size_t size) {
+  int i;
+  if (n_cycle_ev >= MAX_CYCLE_EVENTS) {
+    int victim = -1;
+    for (i = n_cycle_ev - 1; i >= 0; --i) {
+      if (cycle_ev[i].prio < prio && (victim < 0 || cycle_ev[i].prio < cycle_ev[victim].prio)) {
+	victim = i;
+      }
+    }
+    if (victim < 0) {
+      __atomic_fetch_add(&dropped[prio], 1, __ATOMIC_RELAXED);
+      return;
+    }
+    __atomic_fetch_add(&dropped[cycle_ev[victim].prio], 1, __ATOMIC_RELAXED);
+    memmove(&cycle_ev[victim], &cycle_ev[victim + 1], (n_cycle_ev - victim - 1) * sizeof(cycle_event));
+    --n_cycle_ev;
+  }
+  for (i = n_cycle_ev; i > 0 && cycle_ev[i - 1].time > time; --i) {
+    cycle_ev[i] = cycle_ev[i - 1];
+  }
+  cycle_ev[i].time = time;
+  cycle_ev[i].outputs = outputs;
+  cycle_ev[i].prio = prio;
+  cycle_ev[i].size = size;
+  memcpy(cycle_ev[i].data, data, size);
+  ++n_cycle_ev;
+}
+
+/**
+ * model the serial link of a DIN-MIDI output (320 usec per byte):
+ * clock ticks keep their time, other messages are fitted into the gaps,
+ * moved ahead of the next tick if need be to end before it starts.
+ * A tick that cannot go on the wire on time is delayed.
+ * @param skip events that are not sent on this output
+ * @param at set to the time of each event that is sent
+ * @return frames the link is busy after the end of the cycle
+ */
+static double din_schedule(int port, const uint8_t *skip, jack_nframes_t *at, jack_nframes_t nframes, double byte_frames) {
+  double latest[MAX_CYCLE_EVENTS]; ///< latest start of messages that precede a tick
+  double limit = INFINITY;
+  double busy = din_busy[port];
+  int i;
+
+  for (i = n_cycle_ev - 1; i >= 0; --i) {
+    if (skip[i]) continue;
+    if (cycle_ev[i].prio == PRIO_CLOCK) {
+      limit = cycle_ev[i].time;
+    } else {
+      limit -= cycle_ev[i].size * byte_frames;
+      latest[i] = limit;
+    }
+  }
+
+  for (i = 0; i < n_cycle_ev; ++i) {
+    const cycle_event *e = &cycle_ev[i];
+    double t = e->time;
+    if (skip[i]) continue;
+    if (e->prio != PRIO_CLOCK && latest[i] < t) {
+      t = floor(latest[i]);
+    }
+    if (t < busy) {
+      t = ceil(busy);
+    }
+    if (t > nframes - 1) {
+      t = nframes - 1;
+    }
+    at[i] = t;
+    busy = t + e->size * byte_frames;
+  }
+  return busy > nframes ? busy - nframes : 0;
+}
+
+/**
+ * write the events of the cycle that go to the given output to its buffer.
+ * Events are kept in order of priority: when jack cannot reserve an event,
+ * it is dropped along with every event of lower priority and the later
+ * ones of the same priority, and the buffer is written again.
+ * Clock ticks are thus dropped first (latest first), then song-position,
+ * then transport messages. Every event that is not sent is counted.
+ * The MIDI file and RTP-MIDI get the stream of the first output.
+ */
+static void emit_port_events(int port, void *port_buf, jack_nframes_t nframes, double din_byte) {
+  uint8_t skip[MAX_CYCLE_EVENTS]; ///< 1: not for this output, 2: dropped
+  jack_nframes_t at[MAX_CYCLE_EVENTS];
+  double busy = 0;
+  int i, j;
+
+  for (i = 0; i < n_cycle_ev; ++i) {
+    skip[i] = !(cycle_ev[i].outputs & OUTPUT(port));
+    at[i] = cycle_ev[i].time;
+  }
+
+  while (1) {
+    int failed = -1;
+    if (din_outputs & OUTPUT(port)) {
+      busy = din_schedule(port, skip, at, nframes, din_byte);
+    }
+    for (i = 0; i < n_cycle_ev; ++i) {
+      const cycle_event *e = &cycle_ev[i];
+      if (skip[i]) continue;
+      uint8_t *buffer = midi_event_reserve(port_buf, at[i], e->size);
+      if (!buffer) {
+	failed = i;
+	break;
+      }
+      memcpy(buffer, e->data, e->size);
+    }
+    if (failed < 0) {
+      break;
+    }
+    for (j = 0; j < n_cycle_ev; ++j) {
+      if (skip[j]) continue;
+      if (cycle_ev[j].prio < cycle_ev[failed].prio || (cycle_ev[j].prio == cycle_ev[failed].prio && j >= failed)) {
+	__atomic_fetch_add(&dropped[cycle_ev[j].prio], 1, __ATOMIC_RELAXED);
+	skip[j] = 2;
+      }
+    }
+    midi_clear_buffer(port_buf);
   }
 
-  buffer = jack_midi_event_reserve(port_buf, 0, 3);
-  if(!buffer) {
+  if (din_outputs & OUTPUT(port)) {
+    for (i = 0; i < n_cycle_ev; ++i) {
+      if (skip[i] || cycle_ev[i].prio != PRIO_CLOCK || at[i] <= cycle_ev[i].time) continue;
+      const uint32_t us = 1e6 * (at[i] - cycle_ev[i].time) * 10.0 / DIN_BAUD / din_byte;
+      if (us > __atomic_load_n(&din_stats[port].max_delay, __ATOMIC_RELAXED)) {
+	__atomic_store_n(&din_stats[port].max_delay, us, __ATOMIC_RELAXED);
+      }
+      __atomic_fetch_add(&din_stats[port].delayed, 1, __ATOMIC_RELEASE);
+    }
+    din_busy[port] = busy;
+  }
+
+  if (port != 0) {
+    return;
+  }
+  for (i = 0; i < n_cycle_ev; ++i) {
+    const cycle_event *e = &cycle_ev[i];
+    if (skip[i]) continue;
+    smf_record(at[i], e->data, e->size);
+    if (rtp_out) {
+      rtpmidi_send(rtp_out, jack_frames_to_time(j_client, jack_last_frame_time(j_client) + at[i]), e->data, e->size);
+    }
+  }
+}
+
+/**
+ * write the events of the cycle to the port buffers
+ */
+static void emit_events(void **port_buf, jack_nframes_t nframes) {
+  int p;
+  for (p = 0; p < n_outputs; ++p) {
+    emit_port_events(p, port_buf[p], nframes, clock_cfg_cur->din_byte);
+  }
+  n_cycle_ev = 0;
+}
+
+/**
+ * time code of a song position for MTC and MMC: the song position is
+ * converted to transport time at the current tempo.
+ * Both song positions count 4 MIDI beats per jack beat (see calc_song_pos()),
+ * and jack's beats_per_minute is in the same beats, so this holds for any
+ * beat type, independent of -s.
+ * @param tc hours (with the frame-rate code in bits 5,6), minutes, seconds, frames, sub-frames (1/100)
+ */
+static void song_pos_to_timecode(jack_position_t *xpos, int64_t bcnt, uint8_t *tc) {
+  static const uint8_t rate_code[] = { 0, 1, 3 }; // 24, 25, 30 fps
+  double sec = xpos->frame / (double) xpos->frame_rate + (bcnt - song_beats(xpos)) * 15.0 / xpos->beats_per_minute;
+  if (sec < 0) sec = 0;
+  const int fps = tc_fps[tc_rate];
+  const uint64_t cf = floor(sec * fps * 100.0); // centi-frames
+  const uint64_t fr = cf / 100;
+  tc[0] = (rate_code[tc_rate] << 5) | ((fr / (3600 * fps)) % 24);
+  tc[1] = (fr / (60 * fps)) % 60;
+  tc[2] = (fr / fps) % 60;
+  tc[3] = fr % fps;
+  tc[4] = cf % 100;
+}
+
+/**
+ * queue '0xf2' Song Position Pointer.
+ * This is an internal 14 bit register that holds the number of
+ * MIDI beats (1 beat = six MIDI clocks) since the start of the song.
+ * Positions beyond that are sent as MTC full-frame or MMC locate
+ * message, if enabled.
+ * @param outputs bitmask of output ports
+ * @return -1 if the position cannot be sent
+ */
+static int queue_pos_message(uint16_t outputs, jack_position_t *xpos, int64_t bcnt) {
+  uint8_t buffer[MAX_EVENT_SIZE];
+  uint8_t tc[5];
+  if (bcnt < 0) {
     return -1;
   }
-  buffer[0] = 0xf2;
-  buffer[1] = (bcnt)&0x7f; // LSB
-  buffer[2] = (bcnt>>7)&0x7f; // MSB
-  return bcnt;
+  if (bcnt >= 16384 && (long_pos == LP_OFF || !(xpos->valid & JackPositionBBT) || xpos->beats_per_minute <= 0)) {
+    return -1;
+  }
+  if (output_muted) {
+    return 0;
+  }
+
+  if (bcnt < 16384) {
+    buffer[0] = 0xf2;
+    buffer[1] = (bcnt)&0x7f; // LSB
+    buffer[2] = (bcnt>>7)&0x7f; // MSB
+    queue_event(outputs, 0, PRIO_POSITION, buffer, 3);
+    return 0;
+  }
+
+  song_pos_to_timecode(xpos, bcnt, tc);
+  if (long_pos == LP_MTC) {
+    /* MTC full-frame: F0 7F <device> 01 01 hr mn sc fr F7 */
+    const uint8_t msg[10] = { 0xf0, 0x7f, 0x7f, 0x01, 0x01, tc[0], tc[1], tc[2], tc[3], 0xf7 };
+    queue_event(outputs, 0, PRIO_POSITION, msg, sizeof(msg));
+  } else {
+    /* MMC locate: F0 7F <device> 06 44 06 01 hr mn sc fr sf F7 */
+    const uint8_t msg[13] = { 0xf0, 0x7f, 0x7f, 0x06, 0x44, 0x06, 0x01, tc[0], tc[1], tc[2], tc[3], tc[4], 0xf7 };
+    queue_event(outputs, 0, PRIO_POSITION, msg, sizeof(msg));
+  }
+  return 0;
 }
 
 /**
- * send 1 byte MIDI Message
- * @param port_buf buffer to write event to
+ * queue 1 byte MIDI Message
+ * @param outputs bitmask of output ports
  * @param time sample offset of event
  * @param rt_msg message byte
  */
-static void send_rt_message(void* port_buf, jack_nframes_t time, uint8_t rt_msg) {
-  uint8_t *buffer;
-  buffer = jack_midi_event_reserve(port_buf, time, 1);
-  if(buffer) {
-    buffer[0] = rt_msg;
+static void queue_rt_message(uint16_t outputs, jack_nframes_t time, uint8_t rt_msg) {
+  if (output_muted) {
+    return;
+  }
+  queue_event(outputs, time, rt_msg == MIDI_RT_CLOCK ? PRIO_CLOCK : PRIO_TRANSPORT, &rt_msg, 1);
+}
+
+static const int64_t send_pos_message(uint16_t outputs, jack_position_t *xpos, int off) {
+  if (msg_filter & MSG_NO_POSITION) return -1;
+  const int64_t bcnt = calc_song_pos(xpos, off);
+  if (queue_pos_message(outputs, xpos, bcnt)) {
+    return -1;
   }
+  return bcnt;
 }
 
 /**
- * jack process callback.
- * do the work: query jack-transport, send MIDI messages..
+ * @return 1 if the next clock tick is at or after the given song-position,
+ * 'continue' is sent just in time before it.
  */
-static int process (jack_nframes_t nframes, void *arg) {
-  jack_position_t xpos;
-  double samples_per_beat;
-  jack_nframes_t bbt_offset = 0;
-  int ticks_sent_this_cycle = 0;
+static int sync_point_reached(jack_position_t *xpos, int ticks_sent_this_cycle, int64_t sync_point) {
+  const int64_t sync = calc_song_pos(xpos, 0);
+  /* 4 MIDI-beats per quarter note (jack beat) */
+  return sync + ticks_sent_this_cycle / 4 >= sync_point;
+}
 
-  /* query jack transport state */
-  jack_transport_state_t xstate = jack_transport_query(j_client, &xpos);
-  void* port_buf = jack_port_get_buffer(mclk_output_port, nframes);
+/**
+ * resync a device that was connected to one output while the transport
+ * is rolling, without touching the other outputs: send the song-position
+ * of the next bar (at least a quarter note ahead) and queue 'continue'
+ * for it. If the transport is stopped the current song-position is sent.
+ * Requests are kept while the transport is starting or output is muted.
+ */
+static void join_port(int p, jack_transport_state_t xstate, jack_position_t *xpos) {
+  if (xstate == JackTransportStarting || output_muted) {
+    return;
+  }
+  join_request[p] = 0;
 
-  /* prepare MIDI buffer */
-  jack_midi_clear_buffer(port_buf);
+  if (xstate == JackTransportStopped) {
+    /* same position that was sent to all outputs, if any */
+    queue_pos_message(OUTPUT(p), xpos, song_position_sync);
+    return;
+  }
 
-  if (client_state != Run) {
+  if (msg_filter & MSG_NO_TRANSPORT) {
+    return;
+  }
+  if ((msg_filter & MSG_NO_POSITION) || !(xpos->valid & JackPositionBBT)) {
+    queue_rt_message(OUTPUT(p), 0, MIDI_RT_CONTINUE);
+    return;
+  }
+
+  const int64_t now = calc_song_pos(xpos, 0);
+  const double mbeats_per_bar = 4.0 * xpos->beats_per_bar;
+  int64_t target = floor(xpos->bar * mbeats_per_bar);
+  if (target - now < 4) {
+    target = floor((xpos->bar + 1) * mbeats_per_bar);
+  }
+  if (queue_pos_message(OUTPUT(p), xpos, target) == 0) {
+    join_sync[p] = target;
+  }
+}
+
+/**
+ * follow the timecode master while rolling: remember its tempo and
+ * keep track of BBT dropouts.
+ * @return 1 if clock should continue at the last tempo of the master
+ */
+static int flywheel_update (jack_transport_state_t xstate, jack_position_t *xpos, jack_nframes_t nframes, double samplerate) {
+  if (hold_time <= 0 || (force_bpm && user_bpm > 0)) {
+    return 0;
+  }
+
+  if (flywheel.active && (xstate != JackTransportRolling || (xpos->valid & JackPositionBBT))) {
+    /* dropout ended */
+    __atomic_store_n(&fly_stats.last, flywheel.lost, __ATOMIC_RELAXED);
+    if (flywheel.lost > __atomic_load_n(&fly_stats.longest, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&fly_stats.longest, flywheel.lost, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&fly_stats.count, 1, __ATOMIC_RELEASE);
+    flywheel.active = 0;
+    flywheel.relock = xstate == JackTransportRolling;
+  }
+
+  if (xstate != JackTransportRolling) {
+    flywheel.relock = 0;
+    return 0;
+  }
+
+  if (xpos->valid & JackPositionBBT) {
+    flywheel.bpm = xpos->beats_per_minute;
+    flywheel.beat_type = xpos->beat_type;
+    flywheel.valid = 1;
+    return 0;
+  }
+
+  if (!flywheel.valid) {
+    return 0;
+  }
+  if (!flywheel.active) {
+    flywheel.active = 1;
+    flywheel.expired = 0;
+    flywheel.relock = 0;
+    flywheel.lost = 0;
+  }
+  flywheel.lost += nframes;
+  if (flywheel.lost > hold_time * samplerate) {
+    if (!flywheel.expired) {
+      flywheel.expired = 1;
+      __atomic_fetch_add(&fly_stats.expired, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * @return x wrapped into -period/2 .. +period/2
+ */
+static double wrap_phase (double x, double period) {
+  x = fmod(x, period);
+  if (x >= period / 2) x -= period;
+  if (x < -period / 2) x += period;
+  return x;
+}
+
+/**
+ * offset of the next clock tick from the master's beat grid [frames]
+ * @param interval clock tick interval [frames]
+ * @param beat_type beat type that the interval is based on
+ */
+static double grid_phase (jack_position_t *xpos, double interval, double beat_type) {
+  const double clocks_per_beat = 6.0 * beat_type;
+  const double clocks = clocks_per_beat * ((xpos->bar - 1) * xpos->beats_per_bar + (xpos->beat - 1) + xpos->tick / xpos->ticks_per_beat);
+  const double grid = (ceil(clocks) - clocks) * interval; // next tick of the grid, from xpos->frame
+  return wrap_phase(mclk_last_tick + interval - xpos->frame - grid, interval);
+}
+
+/**
+ * phase errors below the resolution of BBT (one tick) are not corrected
+ */
+static double grid_deadband (jack_position_t *xpos, double interval, double beat_type) {
+  return 1.0 + interval * 6.0 * beat_type / xpos->ticks_per_beat;
+}
+
+/**
+ * move the clock phase by up to PHASE_SLEW of the cycle length,
+ * the next tick is not moved before the start of the cycle.
+ * @param err phase error, > 0 if the clock is late [frames]
+ */
+static void slew_phase (jack_position_t *xpos, jack_nframes_t bbt_offset, double interval, double err, jack_nframes_t nframes) {
+  const double limit = PHASE_SLEW * nframes;
+  const double next_tick_offset = mclk_last_tick + interval - xpos->frame - bbt_offset;
+  mclk_last_tick -= fmax(-limit, fmin(fmin(limit, next_tick_offset), err));
+}
+
+/**
+ * measure the offset of the clock from the master's beat grid.
+ * After a dropout slew the clock back to the offset it had before,
+ * instead of jumping.
+ */
+static void flywheel_phase (jack_position_t *xpos, jack_nframes_t bbt_offset, double interval, double beat_type, jack_nframes_t nframes) {
+  const double phase = grid_phase(xpos, interval, beat_type);
+  if (!flywheel.relock) {
+    flywheel.phase = phase;
+    return;
+  }
+  const double err = wrap_phase(phase - flywheel.phase, interval);
+  if (fabs(err) <= grid_deadband(xpos, interval, beat_type)) {
+    flywheel.relock = 0;
+    return;
+  }
+  slew_phase(xpos, bbt_offset, interval, err, nframes);
+}
+
+/**
+ * critically damped tempo filter with a deadband: tempo wobble of the
+ * timecode master is not passed on to the clock. Tempo changes by more
+ * than TEMPO_STEP are followed immediately.
+ * @return filtered tempo
+ */
+static double tempo_smooth (double bpm, jack_nframes_t nframes, double samplerate) {
+  if (!tempo_filter.valid || fabs(bpm - tempo_filter.bpm) > TEMPO_STEP * tempo_filter.bpm) {
+    tempo_filter.bpm = bpm;
+    tempo_filter.vel = 0;
+    tempo_filter.valid = 1;
+    return bpm;
+  }
+  if (fabs(bpm - tempo_filter.bpm) <= smooth_deadband) {
+    bpm = tempo_filter.bpm;
+  }
+
+  /* exact step response of x'' = w^2 (in - x) - 2w x', stable for any cycle length */
+  const double w  = 1.0 / smooth_time;
+  const double t  = nframes / samplerate;
+  const double e0 = tempo_filter.bpm - bpm;
+  const double c  = tempo_filter.vel + w * e0;
+  const double decay = exp(-w * t);
+  tempo_filter.bpm = bpm + (e0 + c * t) * decay;
+  tempo_filter.vel = (tempo_filter.vel - w * c * t) * decay;
+  return tempo_filter.bpm;
+}
+
+/**
+ * keep the clock locked to the master's beat grid while the tempo is
+ * filtered: the phase offset of the first cycle after a start or locate
+ * is kept, deviations are corrected with the filter's time constant.
+ */
+static void tempo_phase_lock (jack_position_t *xpos, jack_nframes_t bbt_offset, double interval, double beat_type, jack_nframes_t nframes, double samplerate) {
+  const double phase = grid_phase(xpos, interval, beat_type);
+  if (!tempo_filter.locked) {
+    tempo_filter.phase = phase;
+    tempo_filter.locked = 1;
+    return;
+  }
+  const double err = wrap_phase(phase - tempo_filter.phase, interval);
+  if (fabs(err) <= grid_deadband(xpos, interval, beat_type)) {
+    return;
+  }
+  slew_phase(xpos, bbt_offset, interval, err * fmin(1.0, nframes / (smooth_time * samplerate)), nframes);
+}
+
+/**
+ * follow the beat grid of the Link session, which link_process() put
+ * into the position: the phase error is corrected gradually, by at most
+ * PHASE_SLEW.
+ */
+static void link_phase_lock (jack_position_t *xpos, jack_nframes_t bbt_offset, double interval, double beat_type, jack_nframes_t nframes) {
+  const double err = grid_phase(xpos, interval, beat_type);
+  if (fabs(err) <= grid_deadband(xpos, interval, beat_type)) {
+    return;
+  }
+  slew_phase(xpos, bbt_offset, interval, err, nframes);
+}
+
+/**
+ * relocate outputs in seamless mode while rolling: the clock keeps
+ * running, the song-position of the next MIDI beat is sent right away
+ * and the next clock tick is moved onto that beat.
+ * @param first_tick set to the transport frame of the next tick
+ * @return bitmask of the outputs that were relocated
+ */
+static uint16_t seamless_relocate(jack_position_t *xpos, double *first_tick) {
+  const uint16_t outputs = seamless_outputs & (OUTPUT(n_outputs) - 1);
+  if (!outputs || !(xpos->valid & JackPositionBBT) || xpos->beats_per_minute <= 0) {
     return 0;
   }
+  const double now = song_beats(xpos);
+  const int64_t next = ceil(now);
+  if (next >= 16384) {
+    /* MTC and MMC locate are not seamless */
+    return 0;
+  }
+  if (queue_pos_message(outputs, xpos, next)) {
+    return 0;
+  }
+  *first_tick = xpos->frame + (next - now) * 15.0 * xpos->frame_rate / xpos->beats_per_minute;
+  return outputs;
+}
+
+/**
+ * prepare the configuration in the back slot and make it pending.
+ * jack serializes the sample-rate and buffer-size callbacks,
+ * there is a single writer.
+ */
+static void config_update (double samplerate, jack_nframes_t buffer_size) {
+  clock_config *c = &clock_cfg[clock_cfg_back];
+  c->samplerate   = samplerate;
+  c->buffer_size  = buffer_size;
+  c->clk_per_qnpm = samplerate * 60.0 / 24.0;
+  c->din_byte     = samplerate * 10.0 / DIN_BAUD;
+  clock_cfg_set = *c;
+  clock_cfg_back = __atomic_exchange_n(&clock_cfg_pending, clock_cfg_back | CFG_PENDING, __ATOMIC_ACQ_REL) & ~CFG_PENDING;
+}
+
+/**
+ * take the pending configuration, if any, for this cycle (process thread)
+ */
+static void config_acquire (void) {
+  if (__atomic_load_n(&clock_cfg_pending, __ATOMIC_RELAXED) & CFG_PENDING) {
+    clock_cfg_front = __atomic_exchange_n(&clock_cfg_pending, clock_cfg_front, __ATOMIC_ACQ_REL) & ~CFG_PENDING;
+  }
+  clock_cfg_cur = &clock_cfg[clock_cfg_front];
+}
+
+/**
+ * generate MIDI clock for one cycle: send start/stop/continue and
+ * song-position on transport state changes and clock ticks while rolling.
+ * @param xstate transport state at the start of the cycle
+ * @param xpos transport position at the start of the cycle
+ * @param nframes cycle length
+ */
+static void generate (jack_transport_state_t xstate, jack_position_t *xpos, jack_nframes_t nframes) {
+  /* clock interval of the previous cycle, re-calculated on change only */
+  static double tick_rate = 0;
+  static double tick_bpm = 0, tick_beat_type = 0;
+  static double clock_tick_interval = 0;
+
+  const clock_config *cfg = clock_cfg_cur;
+  jack_nframes_t bbt_offset = 0;
+  int ticks_sent_this_cycle = 0;
+  double bpm;
+  double first_tick = -1;
+  int hold;
+  int p;
+
+  if (cfg->samplerate != tick_rate) {
+    if (tick_rate > 0 && m_xstate == JackTransportRolling) {
+      /* keep the tick phase: the time since the last tick scales with the sample-rate */
+      mclk_last_tick = xpos->frame - (xpos->frame - mclk_last_tick) * cfg->samplerate / tick_rate;
+    }
+    tick_rate = cfg->samplerate;
+    tick_bpm = 0;
+  }
 
-  /* send position updates if stopped and located */
+  /* send position updates if stopped and located,
+   * at most one per settle time: only the latest position is sent */
   if (xstate == JackTransportStopped && xstate == m_xstate) {
-    if (pos_changed(&last_xpos, &xpos) > 0) {
-      song_position_sync = send_pos_message(port_buf, &xpos, -1);
+    if (pos_changed(&last_xpos, xpos) > 0) {
+      if (spp_limit.pending) {
+	++spp_limit.burst;
+	__atomic_fetch_add(&spp_stats.coalesced, 1, __ATOMIC_RELAXED);
+      }
+      spp_limit.pending = 1;
     }
+    if (spp_limit.pending && spp_limit.wait <= 0) {
+      spp_limit.pending = 0;
+      spp_limit.wait = spp_settle * cfg->samplerate;
+      song_position_sync = send_pos_message(ALL_OUTPUTS, xpos, -1);
+      __atomic_fetch_add(&spp_stats.sent, 1, __ATOMIC_RELAXED);
+    }
+  }
+  remember_pos(&last_xpos, xpos);
+  if (spp_limit.wait > 0) {
+    spp_limit.wait -= nframes;
+  } else if (spp_limit.burst > 0 && !spp_limit.pending) {
+    __atomic_store_n(&spp_stats.last, spp_limit.burst, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&spp_stats.bursts, 1, __ATOMIC_RELEASE);
+    spp_limit.burst = 0;
   }
-  remember_pos(&last_xpos, &xpos);
 
   /* send RT messages start/stop/continue if transport state changed */
   if( xstate != m_xstate ) {
+    /* all outputs are re-synced, pending joins are obsolete */
+    memset(join_sync, 0, sizeof(join_sync));
+    /* the tempo filter starts over */
+    tempo_filter.valid = tempo_filter.locked = 0;
+    sync_outputs = ALL_OUTPUTS;
+    /* a pending locate is superseded by the state change */
+    if (spp_limit.pending) {
+      spp_limit.pending = 0;
+      ++spp_limit.burst;
+      __atomic_fetch_add(&spp_stats.coalesced, 1, __ATOMIC_RELAXED);
+    }
+
     switch(xstate) {
       case JackTransportStopped:
 	if (!(msg_filter & MSG_NO_TRANSPORT)) {
-	  send_rt_message(port_buf, 0, MIDI_RT_STOP);
+	  queue_rt_message(ALL_OUTPUTS, 0, MIDI_RT_STOP);
 	}
-	song_position_sync = send_pos_message(port_buf, &xpos, -1);
+	song_position_sync = send_pos_message(ALL_OUTPUTS, xpos, -1);
+	spp_limit.wait = spp_settle * cfg->samplerate;
 	break;
       case JackTransportRolling:
 	/* handle transport locate while rolling.
@@ -297,14 +1114,16 @@ static int process (jack_nframes_t nframes, void *arg) {
 	 */
 	if(m_xstate == JackTransportStarting && !(msg_filter & MSG_NO_POSITION)) {
 	  if (song_position_sync < 0) {
+	    /* outputs in seamless mode jump, others stop and re-sync */
+	    sync_outputs &= ~seamless_relocate(xpos, &first_tick);
 	    /* send stop IFF not stopped, yet */
-	    send_rt_message(port_buf, 0, MIDI_RT_STOP);
+	    queue_rt_message(sync_outputs, 0, MIDI_RT_STOP);
 	  }
 	  if (song_position_sync != 0) {
 	    /* re-set 'continue' message sync point */
-	    if ((song_position_sync = send_pos_message(port_buf, &xpos, -1)) < 0) {
+	    if ((song_position_sync = send_pos_message(sync_outputs, xpos, -1)) < 0) {
 	      if (!(msg_filter & MSG_NO_TRANSPORT)) {
-		send_rt_message(port_buf, 0, MIDI_RT_CONTINUE);
+		queue_rt_message(sync_outputs, 0, MIDI_RT_CONTINUE);
 	      }
 	    }
 	  } else {
@@ -317,9 +1136,9 @@ static int process (jack_nframes_t nframes, void *arg) {
 	if(m_xstate == JackTransportStarting) {
 	  break;
 	}
-	if( xpos.frame == 0 ) {
+	if( xpos->frame == 0 ) {
 	  if (!(msg_filter & MSG_NO_TRANSPORT)) {
-	    send_rt_message(port_buf, 0, MIDI_RT_START);
+	    queue_rt_message(ALL_OUTPUTS, 0, MIDI_RT_START);
 	    song_position_sync = 0;
 	  }
 	} else {
@@ -328,7 +1147,7 @@ static int process (jack_nframes_t nframes, void *arg) {
 	   * w/song-pos it queued just-in-time
 	   */
 	  if (!(msg_filter & MSG_NO_TRANSPORT) && (msg_filter & MSG_NO_POSITION)) {
-	    send_rt_message(port_buf, 0, MIDI_RT_CONTINUE);
+	    queue_rt_message(ALL_OUTPUTS, 0, MIDI_RT_CONTINUE);
 	  }
 	}
 	break;
@@ -338,92 +1157,572 @@ static int process (jack_nframes_t nframes, void *arg) {
 
     /* initial beat tick */
     if (xstate == JackTransportRolling
-	&& ((xpos.frame == 0) || (msg_filter & MSG_NO_POSITION))
+	&& ((xpos->frame == 0) || (msg_filter & MSG_NO_POSITION))
 	) {
-      send_rt_message(port_buf, 0, MIDI_RT_CLOCK);
+      queue_rt_message(ALL_OUTPUTS, 0, MIDI_RT_CLOCK);
     }
 
-    mclk_last_tick = xpos.frame;
+    mclk_last_tick = xpos->frame;
     m_xstate = xstate;
   }
 
-  if((xstate != JackTransportRolling)) {
-    return 0;
+  /* newly connected devices */
+  for (p = 0; p < n_outputs; ++p) {
+    if (join_request[p]) {
+      join_port(p, xstate, xpos);
+    }
+  }
+
+  hold = flywheel_update(xstate, xpos, nframes, cfg->samplerate);
+
+  if((xstate != JackTransportRolling)) {
+    return;
+  }
+
+  /* calculate clock tick interval */
+  if(force_bpm && user_bpm > 0) {
+    bpm = user_bpm;
+  }
+  else if(xpos->valid & JackPositionBBT) {
+    bpm = xpos->beats_per_minute;
+    if (smooth_time > 0) {
+      bpm = tempo_smooth(bpm, nframes, cfg->samplerate);
+    }
+    if (xpos->valid & JackBBTFrameOffset) {
+      bbt_offset = xpos->bbt_offset;
+    }
+  }
+  else if(hold) {
+    bpm = flywheel.bpm;
+  }
+  else if(user_bpm > 0) {
+    bpm = user_bpm;
+  } else {
+    return; /* no tempo known */
+  }
+
+  /* It is an industry convention that tempo, while reported as "beats
+   * per minute" is actually "quarter notes per minute" in many DAW's.
+   * However, some DAW's/musicians actually use beats per minute
+   * (using the definition of "beat" as the denomitor of the time
+   * signature). While it appears that the JACK transport's intent
+   * is the latter, it's totally up to the DAW to define the tempo/note
+   * relationship. Currently Ardour does "quarter notes per minute."
+   *
+   * Viz. https://community.ardour.org/node/1433
+   *      http://www.steinberg.net/forums/viewtopic.php?t=56065
+   */
+  const double beat_type = (tempo_is_qnpm) ? 4.0 : (hold ? flywheel.beat_type : xpos->beat_type);
+
+  /* MIDI Beat Clock: Send 24 ticks per quarter note  */
+  if (bpm != tick_bpm || beat_type != tick_beat_type) {
+    clock_tick_interval = cfg->clk_per_qnpm * 4.0 / (bpm * beat_type);
+    tick_bpm = bpm;
+    tick_beat_type = beat_type;
+  }
+
+  if (first_tick >= 0) {
+    /* seamless relocate */
+    mclk_last_tick = first_tick - clock_tick_interval;
+  }
+
+  if (flywheel.valid && (xpos->valid & JackPositionBBT) && !(force_bpm && user_bpm > 0)) {
+    flywheel_phase(xpos, bbt_offset, clock_tick_interval, beat_type, nframes);
+  }
+  if (link_mode == LINK_FOLLOW && (xpos->valid & JackPositionBBT) && !(force_bpm && user_bpm > 0)) {
+    link_phase_lock(xpos, bbt_offset, clock_tick_interval, beat_type, nframes);
+  }
+  else if (smooth_time > 0 && (xpos->valid & JackPositionBBT) && !(force_bpm && user_bpm > 0) && !flywheel.relock) {
+    tempo_phase_lock(xpos, bbt_offset, clock_tick_interval, beat_type, nframes, cfg->samplerate);
+  }
+
+
+  /* send clock ticks for this cycle */
+  while(1) {
+#ifdef WITH_JITTER
+    const double next_tick = mclk_last_tick + clock_tick_interval + jitter_rand;
+#else
+    const double next_tick = mclk_last_tick + clock_tick_interval;
+#endif
+    const int64_t next_tick_offset = llrint(next_tick) - xpos->frame - bbt_offset;
+    if (next_tick_offset >= nframes) break;
+
+    if (next_tick_offset >= 0) {
+
+      if (song_position_sync > 0 && !(msg_filter & MSG_NO_POSITION)) {
+	/* send 'continue' realtime message on time */
+	if (sync_point_reached(xpos, ticks_sent_this_cycle, song_position_sync)) {
+	  if (!(msg_filter & MSG_NO_TRANSPORT)) {
+	    queue_rt_message(sync_outputs, next_tick_offset, MIDI_RT_CONTINUE);
+	  }
+	  song_position_sync = -1;
+	}
+      }
+
+      /* 'continue' on the output of a joining device */
+      for (p = 0; p < n_outputs; ++p) {
+	if (join_sync[p] > 0 && sync_point_reached(xpos, ticks_sent_this_cycle, join_sync[p])) {
+	  queue_rt_message(OUTPUT(p), next_tick_offset, MIDI_RT_CONTINUE);
+	  join_sync[p] = 0;
+	}
+      }
+
+      /* enqueue clock tick */
+      queue_rt_message(ALL_OUTPUTS, next_tick_offset, MIDI_RT_CLOCK);
+    }
+
+#ifdef WITH_JITTER
+    if (jitter_level > 0) {
+	    jitter_rand = randf() * jitter_level * clock_tick_interval;
+    }
+#endif
+
+    mclk_last_tick = next_tick;
+    ticks_sent_this_cycle++;
+  }
+}
+
+static double ts_diff (const struct timespec *t0, const struct timespec *t1) {
+  return (t1->tv_sec - t0->tv_sec) + 1e-9 * (t1->tv_nsec - t0->tv_nsec);
+}
+
+/**
+ * apply the freewheel policy when freewheeling starts or ends.
+ * FW_STOP: on entry send stop (if rolling) and the current song-position,
+ * on exit re-sync like a locate: song-position now and continue just in
+ * time if rolling.
+ */
+static void freewheel_changed (jack_transport_state_t xstate, jack_position_t *xpos) {
+  fw_active = freewheeling;
+  output_muted = 0;
+
+  if (fw_active) {
+    memset(&fw_stats, 0, sizeof(fw_stats));
+  } else {
+    fw_stats.done = 1;
+  }
+
+  if (fw_policy == FW_STOP) {
+    if (fw_active) {
+      if (m_xstate != JackTransportStopped && !(msg_filter & MSG_NO_TRANSPORT)) {
+	queue_rt_message(ALL_OUTPUTS, 0, MIDI_RT_STOP);
+      }
+      song_position_sync = send_pos_message(ALL_OUTPUTS, xpos, -1);
+    } else if (xstate == JackTransportStopped) {
+      song_position_sync = send_pos_message(ALL_OUTPUTS, xpos, -1);
+    } else {
+      /* generate() handles this as transport start: Stopped -> Rolling
+       * sends 'continue' right away (w/o song-position), and
+       * Starting -> Rolling sends song-position and queues 'continue'
+       */
+      m_xstate = (msg_filter & MSG_NO_POSITION) ? JackTransportStopped : JackTransportStarting;
+      song_position_sync = 1;
+    }
+  }
+
+  output_muted = fw_active && fw_policy != FW_RUN;
+}
+
+/**
+ * one cycle: freewheel policy, generate and measure the cost while freewheeling
+ */
+static void run_cycle (jack_transport_state_t xstate, jack_position_t *xpos, jack_nframes_t nframes, void **port_buf) {
+  struct timespec t0;
+
+  config_acquire();
+
+  if (freewheeling != fw_active) {
+    freewheel_changed(xstate, xpos);
+  }
+
+  if (!fw_active) {
+    generate(xstate, xpos, nframes);
+    emit_events(port_buf, nframes);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  generate(xstate, xpos, nframes);
+  emit_events(port_buf, nframes);
+  clock_gettime(CLOCK_MONOTONIC, &fw_stats.t1);
+
+  const double dt = ts_diff(&t0, &fw_stats.t1);
+  if (fw_stats.cycles == 0) fw_stats.t0 = t0;
+  if (dt > fw_stats.dsp_max) fw_stats.dsp_max = dt;
+  fw_stats.dsp_sum += dt;
+  fw_stats.frames += nframes;
+  fw_stats.cycles++;
+}
+
+/**
+ * jack process callback.
+ * do the work: query jack-transport, send MIDI messages..
+ */
+#ifdef WITH_LINK
+/**
+ * Link clock at the start of the cycle: the jack time of the cycle
+ * (jack_get_cycle_times) mapped to the Link clock.
+ */
+static int64_t link_cycle_time (void) {
+  jack_nframes_t frames;
+  jack_time_t usecs, next_usecs;
+  float period;
+  if (jack_get_cycle_times(j_client, &frames, &usecs, &next_usecs, &period)) {
+    usecs = jack_frames_to_time(j_client, jack_last_frame_time(j_client));
+  }
+  return usecs + (abl_link_clock_micros(link_session) - (int64_t) jack_get_time());
+}
+
+/**
+ * follow: replace tempo and BBT of the position by the Link session's
+ * unless the transport is stopped, song-position is taken from the
+ * Link timeline.
+ * publish: set the session tempo to the transport's and request the
+ * transport's beat when it starts rolling, at the next quantum.
+ * Link tempo is in quarter-notes per minute.
+ */
+static void link_process (jack_transport_state_t xstate, jack_position_t *xpos) {
+  static jack_transport_state_t prev_xstate = JackTransportStopped;
+  const int64_t t0 = link_cycle_time();
+
+  abl_link_capture_audio_session_state(link_session, link_state);
+
+  if (link_mode == LINK_FOLLOW) {
+    if (xstate == JackTransportStopped) {
+      /* the timeline keeps going, this is no locate */
+      prev_xstate = xstate;
+      return;
+    }
+    const double beat = abl_link_beat_at_time(link_state, t0, LINK_QUANTUM);
+    const double bars = floor(beat / LINK_QUANTUM);
+    const double in_bar = beat - bars * LINK_QUANTUM;
+    xpos->valid = (xpos->valid & ~JackBBTFrameOffset) | JackPositionBBT;
+    xpos->bar = 1 + bars;
+    xpos->beat = 1 + floor(in_bar);
+    xpos->tick = (in_bar - floor(in_bar)) * LINK_TICKS_PER_BEAT;
+    xpos->bar_start_tick = bars * LINK_QUANTUM * LINK_TICKS_PER_BEAT;
+    xpos->beats_per_bar = LINK_QUANTUM;
+    xpos->beat_type = 4;
+    xpos->ticks_per_beat = LINK_TICKS_PER_BEAT;
+    xpos->beats_per_minute = abl_link_tempo(link_state);
+  } else {
+    short commit = 0;
+    double bpm = 0;
+    if ((xpos->valid & JackPositionBBT) && !(force_bpm && user_bpm > 0)) {
+      bpm = tempo_is_qnpm ? xpos->beats_per_minute : xpos->beats_per_minute * 4.0 / xpos->beat_type;
+    } else if (user_bpm > 0) {
+      bpm = user_bpm;
+    }
+    if (bpm > 0 && fabs(bpm - abl_link_tempo(link_state)) > 1e-3) {
+      abl_link_set_tempo(link_state, bpm, t0);
+      commit = 1;
+    }
+    if (xstate == JackTransportRolling && prev_xstate != JackTransportRolling && (xpos->valid & JackPositionBBT)) {
+      abl_link_request_beat_at_time(link_state, song_beats(xpos) / 4.0, t0, LINK_QUANTUM);
+      commit = 1;
+    }
+    if (commit) {
+      abl_link_commit_audio_session_state(link_session, link_state);
+    }
+  }
+  prev_xstate = xstate;
+}
+#endif
+
+static int process (jack_nframes_t nframes, void *arg) {
+  jack_position_t xpos;
+  void* port_buf[MAX_OUTPUTS];
+  int p;
+
+  /* query jack transport state */
+  jack_transport_state_t xstate = jack_transport_query(j_client, &xpos);
+
+  /* prepare MIDI buffers */
+  for (p = 0; p < n_outputs; ++p) {
+    port_buf[p] = jack_port_get_buffer(mclk_output_port[p], nframes);
+    jack_midi_clear_buffer(port_buf[p]);
+  }
+
+  if (client_state != Run) {
+    return 0;
+  }
+
+  if (smf_rb) {
+    /* extend frame time to 64bit for the MIDI file */
+    static jack_nframes_t last_frame_time = 0;
+    const jack_nframes_t ft = jack_last_frame_time(j_client);
+    cycle_frames += (jack_nframes_t) (ft - last_frame_time);
+    last_frame_time = ft;
+  }
+
+#ifdef WITH_LINK
+  if (link_mode != LINK_OFF) {
+    link_process(xstate, &xpos);
+  }
+#endif
+
+  run_cycle(xstate, &xpos, nframes, port_buf);
+
+  if (smf_queued) {
+    /* wake the MIDI file writer once per cycle */
+    smf_queued = 0;
+    sem_post(&smf_ready);
+  }
+  return 0;
+}
+
+/**
+ * print the number of events that could not be sent, if it changed
+ */
+static void report_dropped (void) {
+  static uint32_t reported = 0;
+  uint32_t d[PRIO_LAST];
+  uint32_t total = 0;
+  int i;
+  for (i = 0; i < PRIO_LAST; ++i) {
+    d[i] = __atomic_load_n(&dropped[i], __ATOMIC_RELAXED);
+    total += d[i];
+  }
+  if (total == reported) {
+    return;
+  }
+  reported = total;
+  fprintf(stderr, "MIDI buffer overflow, dropped events: %u clock, %u song-position, %u start/stop/continue\n",
+      d[PRIO_CLOCK], d[PRIO_POSITION], d[PRIO_TRANSPORT]);
+}
+
+/**
+ * print the number of events RTP-MIDI could not send (no session or
+ * queue full), if it changed; while dropping goes on at most every 10 sec
+ * @param final report any change, on exit
+ */
+static void report_rtp_dropped (short final) {
+  static uint32_t reported = 0;
+  static time_t last = 0;
+  uint32_t d;
+  if (!rtp_out) {
+    return;
+  }
+  d = rtpmidi_dropped(rtp_out);
+  if (d == reported || (!final && time(NULL) - last < 10)) {
+    return;
+  }
+  reported = d;
+  last = time(NULL);
+  fprintf(stderr, "RTP-MIDI: %u events dropped (no session or queue full)\n", d);
+}
+
+/**
+ * print timecode master dropouts that ended or exceeded the hold time
+ */
+static void report_flywheel (void) {
+  static uint32_t reported = 0, reported_expired = 0;
+  const uint32_t count = __atomic_load_n(&fly_stats.count, __ATOMIC_ACQUIRE);
+  const uint32_t expired = __atomic_load_n(&fly_stats.expired, __ATOMIC_RELAXED);
+  if (expired != reported_expired) {
+    reported_expired = expired;
+    fprintf(stderr, "timecode master lost for more than %.1f sec, flywheel released\n", hold_time);
   }
-
-  /* calculate clock tick interval */
-  if(force_bpm && user_bpm > 0) {
-    samples_per_beat = (double) xpos.frame_rate * 60.0 / user_bpm;
+  if (count == reported) {
+    return;
   }
-  else if(xpos.valid & JackPositionBBT) {
-    samples_per_beat = (double) xpos.frame_rate * 60.0 / xpos.beats_per_minute;
-    if (xpos.valid & JackBBTFrameOffset) {
-      bbt_offset = xpos.bbt_offset;
+  reported = count;
+  const double rate = jack_get_sample_rate(j_client);
+  fprintf(stderr, "timecode master dropout: %.2f sec, %u dropouts, longest %.2f sec, %u exceeded the hold time\n",
+      __atomic_load_n(&fly_stats.last, __ATOMIC_RELAXED) / rate, count,
+      __atomic_load_n(&fly_stats.longest, __ATOMIC_RELAXED) / rate, expired);
+}
+
+/**
+ * print clock ticks that were delayed on a DIN-MIDI link, if it changed
+ */
+static void report_din (void) {
+  static uint32_t reported[MAX_OUTPUTS];
+  int p;
+  for (p = 0; p < n_outputs; ++p) {
+    const uint32_t delayed = __atomic_load_n(&din_stats[p].delayed, __ATOMIC_ACQUIRE);
+    if (delayed == reported[p]) {
+      continue;
     }
+    reported[p] = delayed;
+    fprintf(stderr, "DIN-MIDI output %d: %u clock ticks delayed on the wire, up to %u usec\n",
+	p + 1, delayed, __atomic_load_n(&din_stats[p].max_delay, __ATOMIC_RELAXED));
   }
-  else if(user_bpm > 0) {
-    samples_per_beat = (double) xpos.frame_rate * 60.0 / user_bpm;
-  } else {
-    return 0; /* no tempo known */
+}
+
+/**
+ * print song-positions that were coalesced, once a locate burst settled
+ */
+static void report_coalesced (void) {
+  static uint32_t reported = 0;
+  const uint32_t bursts = __atomic_load_n(&spp_stats.bursts, __ATOMIC_ACQUIRE);
+  if (bursts == reported) {
+    return;
   }
+  reported = bursts;
+  fprintf(stderr, "locate settled: %u song-position messages coalesced, %u of %u suppressed in total\n",
+      __atomic_load_n(&spp_stats.last, __ATOMIC_RELAXED),
+      __atomic_load_n(&spp_stats.coalesced, __ATOMIC_RELAXED),
+      __atomic_load_n(&spp_stats.coalesced, __ATOMIC_RELAXED) + __atomic_load_n(&spp_stats.sent, __ATOMIC_RELAXED));
+}
 
-  /* It is an industry convention that tempo, while reported as "beats
-   * per minute" is actually "quarter notes per minute" in many DAW's.
-   * However, some DAW's/musicians actually use beats per minute
-   * (using the definition of "beat" as the denomitor of the time
-   * signature). While it appears that the JACK transport's intent
-   * is the latter, it's totally up to the DAW to define the tempo/note
-   * relationship. Currently Ardour does "quarter notes per minute."
-   *
-   * Viz. https://community.ardour.org/node/1433
-   *      http://www.steinberg.net/forums/viewtopic.php?t=56065
-   */
-  const double quarter_notes_per_beat = (tempo_is_qnpm) ? 1.0 : (xpos.beat_type / 4.0);
+/* offline rendering */
+#define RENDER_MAX_EVENTS (1024)
 
-  /* MIDI Beat Clock: Send 24 ticks per quarter note  */
-  const double samples_per_quarter_note = samples_per_beat / quarter_notes_per_beat;
-  const double clock_tick_interval = samples_per_quarter_note / 24.0;
+struct render_buffer {
+  jack_nframes_t nframes;
+  int n;
+  midi_record ev[RENDER_MAX_EVENTS]; ///< time relative to cycle start
+};
 
+/**
+ * replaces jack_midi_event_reserve() when rendering,
+ * with the same constraints: events in order, within the cycle.
+ */
+static jack_midi_data_t* render_reserve (void *port_buffer, jack_nframes_t time, size_t data_size) {
+  struct render_buffer *b = (struct render_buffer*) port_buffer;
+  midi_record *r;
+  if (b->n >= RENDER_MAX_EVENTS || data_size > sizeof(r->data) || time >= b->nframes) {
+    return NULL;
+  }
+  if (b->n > 0 && time < b->ev[b->n - 1].time) {
+    return NULL;
+  }
+  r = &b->ev[b->n++];
+  r->time = time;
+  r->size = data_size;
+  return r->data;
+}
 
-  /* send clock ticks for this cycle */
-  while(1) {
-#ifdef WITH_JITTER
-    const double next_tick = mclk_last_tick + clock_tick_interval + jitter_rand;
-#else
-    const double next_tick = mclk_last_tick + clock_tick_interval;
-#endif
-    const int64_t next_tick_offset = llrint(next_tick) - xpos.frame - bbt_offset;
-    if (next_tick_offset >= nframes) break;
+/**
+ * replaces jack_midi_clear_buffer() when rendering
+ */
+static void render_clear_buffer (void *port_buffer) {
+  ((struct render_buffer*) port_buffer)->n = 0;
+}
 
-    if (next_tick_offset >= 0) {
+/**
+ * run generate() on simulated cycles, driven by a tempo map
+ * and transport script, as fast as possible.
+ * Transport follows jack semantics: start and locate while rolling
+ * pass through 'Starting' for one cycle.
+ */
+static int render (const char *fn) {
+  struct render_buffer buf;
+  void *port_buf[1] = { &buf };
+  struct timespec t0, t1;
+  double dsp_sum = 0, dsp_max = 0;
+  jack_transport_state_t xstate = JackTransportStopped;
+  smf_writer *w = NULL;
+  uint64_t frames = 0;
+  uint64_t n_events = 0;
+  double tframe = 0;
+  int cue = 0;
+  int rv = 0;
+  tempomap tm;
+
+  if (tempomap_load(&tm, fn, render_rate)) {
+    return -1;
+  }
+  if (tm.n_cue == 0 || tm.cue[tm.n_cue - 1].type != TM_END) {
+    fprintf(stderr, "tempo map '%s' has no 'end'\n", fn);
+    tempomap_free(&tm);
+    return -1;
+  }
+  if (smf_file && !(w = smf_writer_open(smf_file, render_rate, smf_ppqn))) {
+    fprintf(stderr, "cannot create MIDI file '%s'\n", smf_file);
+    tempomap_free(&tm);
+    return -1;
+  }
 
-      if (song_position_sync > 0 && !(msg_filter & MSG_NO_POSITION)) {
-	/* send 'continue' realtime message on time */
-	const int64_t sync = calc_song_pos(&xpos, 0);
-	/* 4 MIDI-beats per quarter note (jack beat) */
-	if (sync + ticks_sent_this_cycle / 4 >= song_position_sync) {
-	  if (!(msg_filter & MSG_NO_TRANSPORT)) {
-	    send_rt_message(port_buf, next_tick_offset, MIDI_RT_CONTINUE);
-	  }
-	  song_position_sync = -1;
-	}
+  midi_event_reserve = render_reserve;
+  midi_clear_buffer = render_clear_buffer;
+  n_outputs = 1;
+  config_update(render_rate, render_period);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  while (1) {
+    jack_position_t xpos;
+    struct timespec c0, c1;
+    short done = 0;
+    double dt;
+    int i;
+
+    /* transport changes take effect at the start of a cycle */
+    for (; cue < tm.n_cue && tm.cue[cue].time * render_rate < frames + render_period; ++cue) {
+      switch (tm.cue[cue].type) {
+	case TM_START:
+	  if (xstate == JackTransportStopped) xstate = JackTransportStarting;
+	  break;
+	case TM_STOP:
+	  xstate = JackTransportStopped;
+	  break;
+	case TM_LOCATE:
+	  tframe = tm.cue[cue].frame;
+	  if (xstate != JackTransportStopped) xstate = JackTransportStarting;
+	  break;
+	case TM_FREEWHEEL:
+	  freewheeling = tm.cue[cue].frame != 0;
+	  break;
+	default:
+	  done = 1;
+	  break;
       }
-
-      /* enqueue clock tick */
-      send_rt_message(port_buf, next_tick_offset, MIDI_RT_CLOCK);
     }
-
-#ifdef WITH_JITTER
-    if (jitter_level > 0) {
-	    jitter_rand = randf() * jitter_level * clock_tick_interval;
+    if (done) break;
+
+    memset(&xpos, 0, sizeof(jack_position_t));
+    xpos.frame = tframe;
+    xpos.frame_rate = render_rate;
+    tempomap_position(&tm, &xpos);
+
+    render_clear_buffer(&buf);
+    buf.nframes = render_period;
+    clock_gettime(CLOCK_MONOTONIC, &c0);
+    run_cycle(xstate, &xpos, render_period, port_buf);
+    clock_gettime(CLOCK_MONOTONIC, &c1);
+    dt = ts_diff(&c0, &c1);
+    if (dt > dsp_max) dsp_max = dt;
+    dsp_sum += dt;
+
+    for (i = 0; i < buf.n; ++i) {
+      const midi_record *r = &buf.ev[i];
+      if (w) {
+	smf_writer_event(w, frames + r->time, r->data, r->size);
+      } else {
+	int k;
+	printf("%llu", (unsigned long long) (frames + r->time));
+	for (k = 0; k < r->size; ++k) {
+	  printf(" %02x", r->data[k]);
+	}
+	printf("\n");
+      }
     }
-#endif
+    n_events += buf.n;
 
-    mclk_last_tick = next_tick;
-    ticks_sent_this_cycle++;
+    frames += render_period;
+    if (xstate == JackTransportRolling) tframe += render_period;
+    if (xstate == JackTransportStarting) xstate = JackTransportRolling;
   }
 
-  return 0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (w && smf_writer_close(w)) {
+    fprintf(stderr, "error writing MIDI file '%s'\n", smf_file);
+    rv = -1;
+  }
+  fprintf(stderr, "rendered %.1f sec, %llu events in %.3f sec\n",
+      frames / render_rate, (unsigned long long) n_events, ts_diff(&t0, &t1));
+  if (frames > 0) {
+    const double period = render_period / render_rate;
+    const uint64_t cycles = frames / render_period;
+    fprintf(stderr, "cycle cost: avg %.2f us, max %.2f us, period %.0f us (%.0fx realtime)\n",
+	1e6 * dsp_sum / cycles, 1e6 * dsp_max, 1e6 * period, frames / render_rate / fmax(dsp_sum, 1e-9));
+  }
+  report_dropped();
+  report_coalesced();
+  report_din();
+  tempomap_free(&tm);
+  return rv;
 }
 
 /**
@@ -435,6 +1734,148 @@ static void jack_shutdown (void *arg) {
   wake_main_now();
 }
 
+/**
+ * callback if jack enters or leaves freewheel mode,
+ * process() applies the policy at the start of the next cycle
+ */
+static void jack_freewheel (int starting, void *arg) {
+  freewheeling = starting ? 1 : 0;
+  if (!starting) {
+    fw_ended = 1;
+    wake_main_now();
+  }
+}
+
+/**
+ * print the statistics of the last freewheel run,
+ * called by the main thread after freewheeling ended
+ */
+static void freewheel_report (void) {
+  int i;
+  /* wait for process() to notice */
+  for (i = 0; i < 100 && !fw_stats.done && client_state == Run; ++i) {
+    usleep(10000);
+  }
+  if (!fw_stats.done || fw_stats.cycles == 0) {
+    return;
+  }
+  fw_stats.done = 0;
+
+  const double elapsed = ts_diff(&fw_stats.t0, &fw_stats.t1);
+  const double rate = jack_get_sample_rate(j_client);
+  fprintf(stderr, "freewheel: %.1f sec in %.3f sec (%.0fx realtime), %llu cycles, cost avg %.2f us max %.2f us\n",
+      fw_stats.frames / rate, elapsed, elapsed > 0 ? fw_stats.frames / rate / elapsed : 0,
+      (unsigned long long) fw_stats.cycles,
+      1e6 * fw_stats.dsp_sum / fw_stats.cycles, 1e6 * fw_stats.dsp_max);
+}
+
+/**
+ * callback if ports are connected or disconnected,
+ * process() re-syncs outputs that gained a connection
+ */
+static void jack_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect, void *arg) {
+  jack_port_t *src = jack_port_by_id(j_client, a);
+  int p;
+  if (!connect) {
+    return;
+  }
+  for (p = 0; p < n_outputs; ++p) {
+    if (src && src == mclk_output_port[p]) {
+      join_request[p] = 1;
+    }
+  }
+}
+
+static int jack_srate_cb (jack_nframes_t nframes, void *arg) {
+  config_update(nframes, clock_cfg_set.buffer_size);
+  return 0;
+}
+
+static int jack_bufsiz_cb (jack_nframes_t nframes, void *arg) {
+  config_update(clock_cfg_set.samplerate, nframes);
+  return 0;
+}
+
+/**
+ * set up configuration and callbacks, before activating the client
+ */
+static void jack_callbacks (jack_client_t *client) {
+  config_update(jack_get_sample_rate(client), jack_get_buffer_size(client));
+  jack_set_process_callback (client, process, 0);
+  jack_set_freewheel_callback (client, jack_freewheel, 0);
+  jack_set_sample_rate_callback (client, jack_srate_cb, 0);
+  jack_set_buffer_size_callback (client, jack_bufsiz_cb, 0);
+  jack_set_port_connect_callback (client, jack_connect_cb, 0);
+}
+
+/**
+ * jack timebase callback: bar, beat, tick, tempo and meter from the
+ * tempo map, O(log n). The map was loaded at the sample-rate of the
+ * time, positions are scaled if it changed since.
+ */
+static void jack_timebase_cb (jack_transport_state_t state, jack_nframes_t nframes, jack_position_t *pos, int new_pos, void *arg) {
+  const tempomap *tm = (const tempomap*) arg;
+  double frame = pos->frame;
+  if (pos->frame_rate > 0 && pos->frame_rate != tm->samplerate) {
+    frame *= tm->samplerate / pos->frame_rate;
+  }
+  tempomap_position_at(tm, frame, pos);
+}
+
+/**
+ * load the tempo map and become timebase master, unless there already
+ * is one: a running DAW stays in charge.
+ */
+static int timebase_setup (void) {
+  int rv;
+  if (tempomap_load(&timebase_map, timebase_file, jack_get_sample_rate(j_client))) {
+    return -1;
+  }
+  if ((rv = jack_set_timebase_callback(j_client, 1, jack_timebase_cb, &timebase_map))) {
+    if (rv == EBUSY) {
+      fprintf(stderr, "another timebase master is active, ignoring the tempo map\n");
+      return 0;
+    }
+    fprintf(stderr, "cannot become timebase master\n");
+    return -1;
+  }
+  return 0;
+}
+
+#ifdef WITH_LINK
+static void link_peers_cb (uint64_t num_peers, void *context) {
+  fprintf(stderr, "Link: %llu peers\n", (unsigned long long) num_peers);
+}
+
+/**
+ * join the Link session, call before jack_activate()
+ */
+static int link_setup (void) {
+  link_session = abl_link_create(user_bpm > 0 ? user_bpm : 120.0);
+  link_state = abl_link_create_session_state();
+  if (!link_session.impl || !link_state.impl) {
+    fprintf(stderr, "cannot create Link session\n");
+    return -1;
+  }
+  abl_link_set_num_peers_callback(link_session, link_peers_cb, NULL);
+  abl_link_enable(link_session, true);
+  return 0;
+}
+
+/**
+ * leave the Link session, call after the jack client was closed
+ */
+static void link_close (void) {
+  if (link_session.impl) {
+    abl_link_enable(link_session, false);
+    abl_link_destroy(link_session);
+  }
+  if (link_state.impl) {
+    abl_link_destroy_session_state(link_state);
+  }
+}
+#endif
+
 /**
  * open a client connection to the JACK server
  */
@@ -456,7 +1897,7 @@ static int init_jack(const char *client_name) {
     fprintf (stderr, "jack-client name: `%s'\n", client_name);
   }
 
-  jack_set_process_callback (j_client, process, 0);
+  jack_callbacks (j_client);
 #ifndef WIN32
   jack_on_shutdown (j_client, jack_shutdown, NULL);
 #endif
@@ -465,17 +1906,62 @@ static int init_jack(const char *client_name) {
 }
 
 static int jack_portsetup(void) {
-  if ((mclk_output_port = jack_port_register(j_client, "mclk_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
-    fprintf (stderr, "cannot register mclk output port !\n");
-    return (-1);
+  int p;
+  for (p = 0; p < n_outputs; ++p) {
+    char name[32];
+    if (n_outputs == 1) {
+      strcpy(name, "mclk_out");
+    } else {
+      snprintf(name, sizeof(name), "mclk_out_%d", p + 1);
+    }
+    if ((mclk_output_port[p] = jack_port_register(j_client, name, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
+      fprintf (stderr, "cannot register mclk output port '%s'!\n", name);
+      return (-1);
+    }
   }
   return (0);
 }
 
-static void port_connect(char *mclk_port) {
-  if (mclk_port && jack_connect(j_client, jack_port_name(mclk_output_port), mclk_port)) {
-    fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(mclk_output_port), mclk_port);
+/**
+ * start the RTP-MIDI sender, rtp_peer is "host[:port]"
+ */
+static int rtp_setup(void) {
+  char *colon = strrchr(rtp_peer, ':');
+  int port = RTPMIDI_PORT;
+  if (colon && colon == strchr(rtp_peer, ':')) {
+    /* not an IPv6 address */
+    *colon = '\0';
+    port = atoi(colon + 1);
+    if (port < 1 || port > 65534) {
+      fprintf(stderr, "Invalid RTP-MIDI port, should be 1 <= port < 65535.\n");
+      return -1;
+    }
+  }
+  if (!(rtp_out = rtpmidi_open(rtp_peer, port, jack_get_client_name(j_client)))) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * connect the outputs to the ports given on the command line in order,
+ * the last output takes all remaining ones. Now and whenever a matching
+ * port appears later on.
+ */
+static int port_rules_setup(int argc, char **argv) {
+  int i;
+  if (optind >= argc) {
+    return 0;
+  }
+  if (!(port_rules = autoconnect_new(j_client, wake_main_now))) {
+    return -1;
+  }
+  for (i = 0; optind < argc; ++i) {
+    if (autoconnect_add(port_rules, argv[optind++], mclk_output_port[i < n_outputs ? i : n_outputs - 1])) {
+      return -1;
+    }
   }
+  return 0;
 }
 
 static void catchsig (int sig) {
@@ -490,16 +1976,55 @@ static void catchsig (int sig) {
  * main application code
  */
 
+/**
+ * parse a list of output numbers (1 based), e.g. "1,3", or "all"
+ * @return bitmask of outputs
+ */
+static uint16_t parse_outputs (char *arg) {
+  uint16_t outputs = 0;
+  char *tok, *save = NULL;
+  if (!strcmp(arg, "all")) {
+    return ALL_OUTPUTS;
+  }
+  for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    const int o = atoi(tok);
+    if (o < 1 || o > MAX_OUTPUTS) {
+      fprintf(stderr, "Invalid output '%s', should be 1 <= n <= %d or 'all'. Ignored.\n", tok, MAX_OUTPUTS);
+      continue;
+    }
+    outputs |= OUTPUT(o - 1);
+  }
+  return outputs;
+}
+
 static struct option const long_options[] =
 {
   {"bpm", required_argument, 0, 'b'},
   {"force-bpm", no_argument, 0, 'B'},
+  {"freewheel", required_argument, 0, 'F'},
+  {"hold", required_argument, 0, 'H'},
   {"resync-delay", required_argument, 0, 'd'},
+  {"din", required_argument, 0, 'D'},
   {"jitter-level", required_argument, 0, 'J'},
+  {"link", required_argument, 0, 'k'},
+  {"seamless", required_argument, 0, 'j'},
+  {"fps", required_argument, 0, 'f'},
+  {"long-position", required_argument, 0, 'L'},
   {"help", no_argument, 0, 'h'},
+  {"midi-file", required_argument, 0, 'M'},
+  {"tempo-map", required_argument, 0, 'm'},
+  {"rtp-midi", required_argument, 0, 'n'},
   {"no-position", no_argument, 0, 'P'},
+  {"outputs", required_argument, 0, 'o'},
+  {"period", required_argument, 0, 'p'},
+  {"ppqn", required_argument, 0, 'Q'},
+  {"render", required_argument, 0, 'R'},
+  {"smooth", required_argument, 0, 'S'},
+  {"deadband", required_argument, 0, 'z'},
+  {"samplerate", required_argument, 0, 'r'},
   {"no-transport", no_argument, 0, 'T'},
   {"strict-bpm", no_argument, 0, 's'},
+  {"settle", required_argument, 0, 't'},
   {"version", no_argument, 0, 'V'},
   {NULL, 0, NULL, 0}
 };
@@ -512,17 +2037,62 @@ static void usage (int status) {
 "  -b <bpm>, --bpm <bpm>\n"
 "                         default BPM (if jack timecode master in not available)\n"
 "  -B, --force-bpm        ignore jack timecode master\n"
+"  -F <policy>, --freewheel <policy>\n"
+"                         what to send while jack is freewheeling:\n"
+"                         'run', 'mute' or 'stop' (default: run)\n"
+"  -H <sec>, --hold <sec>\n"
+"                         keep clocking at the last tempo for up to <sec>\n"
+"                         if the timecode master disappears (default: 0, off)\n"
 "  -d <sec>, --resync-delay <sec>\n"
 "                         seconds between 'song-position' and 'continue' message\n"
+"  -D <outputs>, --din <outputs>\n"
+"                         outputs that drive a 31.25 kbaud DIN-MIDI link:\n"
+"                         'all' or a list, e.g. '1,3'\n"
+"  -f <fps>, --fps <fps>  frame-rate of MTC and MMC positions: 24, 25 or 30\n"
+"                         (default: 25)\n"
 "  -J, --jitter-level <percent>\n"
 "                         add artificial jitter to the signal 0..20%%\n"
 "                         default: off (0)\n"
+"  -j <outputs>, --seamless <outputs>\n"
+"                         relocate without stop while rolling on the given\n"
+"                         outputs: 'all' or a list, e.g. '1,3'\n"
+"  -k <mode>, --link <mode>\n"
+"                         join an Ableton Link session: 'follow' its tempo\n"
+"                         and phase or 'publish' the transport tempo\n"
+"  -L <mode>, --long-position <mode>\n"
+"                         song positions beyond the range of song-position:\n"
+"                         'mtc', 'mmc' or 'off' (default: off)\n"
+"  -M <file>, --midi-file <file>\n"
+"                         write all sent events to a Standard MIDI File\n"
+"  -m <file>, --tempo-map <file>\n"
+"                         act as JACK timebase master with the tempo map\n"
+"                         of the file (see below)\n"
+"  -n <host>[:<port>], --rtp-midi <host>[:<port>]\n"
+"                         send the stream of the first output as RTP-MIDI\n"
+"                         to the given host (default port: 5004)\n"
+"  -o <num>, --outputs <num>\n"
+"                         number of output ports to register (default: 1)\n"
 "  -P, --no-position      do not send song-position (0xf2) messages\n"
+"  -p <frames>, --period <frames>\n"
+"                         cycle size used for rendering (default: 1024)\n"
+"  -Q <num>, --ppqn <num> resolution of the MIDI file (default: 960)\n"
+"  -r <Hz>, --samplerate <Hz>\n"
+"                         sample-rate used for rendering (default: 48000)\n"
+"  -R <file>, --render <file>\n"
+"                         render clock of a tempo map offline (see below)\n"
+"  -S <sec>, --smooth <sec>\n"
+"                         filter the tempo of the timecode master with the\n"
+"                         given time constant (default: 0, off)\n"
 "  -T, --no-transport     do not send start/stop/continue messages\n"
 "  -s, --strict-bpm       interpret tempo strictly as beats per minute (default\n"
 "                         is quarter-notes per minute)\n"
+"  -t <sec>, --settle <sec>\n"
+"                         send at most one song-position per <sec> while\n"
+"                         stopped and locating (default: 0, off)\n"
 "  -h, --help             display this help and exit\n"
 "  -V, --version          print version information and exit\n"
+"  -z <bpm>, --deadband <bpm>\n"
+"                         tempo filter: ignore changes up to <bpm> (default: 0.1)\n"
 
 "\n");
   printf ("\n"
@@ -540,11 +2110,50 @@ static void usage (int status) {
 "is present. Combined with the -B option it can used to override and ignore\n"
 "the JACK timecode master and only act on transport state alone.\n"
 "\n"
-"Either way, jack_midi_clock will never act as timecode master itself.\n"
+"With -k jack_midi_clock joins an Ableton Link session on the local network\n"
+"(requires a build with 'make WITH_LINK=1'). In 'follow' mode the session\n"
+"replaces the timecode master: tempo, phase and song-position come from the\n"
+"Link timeline (4 beats per bar), the clock is moved onto its beat grid\n"
+"gradually, start and stop still follow the JACK transport. In 'publish'\n"
+"mode the transport tempo (or -b) is set as session tempo and the transport's\n"
+"beat is requested when it starts rolling. Link time is mapped to the JACK\n"
+"cycle time.\n"
+"\n"
+"Without a DAW, jack_midi_clock can be the timecode master itself: with -m\n"
+"it provides bar, beat, tick, tempo and meter from a tempo map file in the\n"
+"format described for -R below, transport commands in it are ignored. If\n"
+"another timecode master is already present, it is left in charge.\n"
+"\n"
+"If the timecode master stops providing bar, beat, tick while the transport\n"
+"is rolling (e.g. it restarts or crashes), the -H option keeps the clock\n"
+"running at the last tempo and phase for the given time, before falling back\n"
+"to the -b tempo or stopping the clock. When the master is back, the clock\n"
+"phase is moved back to the master's beat grid gradually (by at most 1%%\n"
+"of the tempo) instead of jumping. Dropouts are reported on stderr.\n"
+"\n"
+"Some timecode masters publish a tempo that wobbles slightly every cycle.\n"
+"With -S the tempo is smoothed by a critically damped filter, changes within\n"
+"the deadband (-z) are ignored and changes by more than 5%% are followed\n"
+"immediately. The clock stays locked to the master's beat grid: the phase\n"
+"after a start or locate is kept, deviations caused by the filter are\n"
+"corrected with the same time constant.\n"
 "\n"
 "Note that song-position information is only sent if a timecode master is\n"
 "present ad the -P option is not given.\n"
 "\n"
+"Song-position messages can address 16384 MIDI beats (1024 bars in 4/4).\n"
+"Later positions are not sent unless -L selects MTC full-frame or MMC\n"
+"locate SysEx messages, at the frame-rate given with -f. The song position\n"
+"is converted to transport time at the current tempo, in beats of the\n"
+"time signature (also with -s). 'continue' is sent just in time, as with\n"
+"song-position.\n"
+"\n"
+"Outputs given with -j are relocated seamlessly while rolling: the clock keeps\n"
+"running, the song-position of the next MIDI beat (a 16th note) is sent right\n"
+"away and the next clock tick is moved onto that beat. This requires devices\n"
+"that accept song-position while playing. Other outputs stop and re-sync as\n"
+"described below.\n"
+"\n"
 "To allow external synths to accurately sync to song-position, there is a two\n"
 "second delay between the 'song-position changed' message (which is not a MIDI\n"
 "realtime message) and the 'continue transport' message.\n"
@@ -552,6 +2161,73 @@ static void usage (int status) {
 "playback starts at a bar|beat|tick other than 1|1|0 in which case a 'start'\n"
 "message is sent immediately.\n"
 "\n"
+"If the JACK MIDI buffer can not hold all events of a cycle, clock ticks are\n"
+"dropped first, then song-position, then start/stop/continue messages.\n"
+"Dropped events are counted and reported on stderr.\n"
+"\n"
+"A DIN-MIDI link needs 320 usec per byte, a 3 byte song-position next to\n"
+"a clock tick delays the tick by up to a millisecond. For outputs given with\n"
+"-D the link is modelled: clock ticks are sent at their exact time, other\n"
+"messages are fitted into the gaps between them, if need be ahead of their\n"
+"time. Ticks that still go on the wire late are reported on stderr.\n"
+"\n"
+"Scrubbing the timeline while stopped locates the transport every cycle.\n"
+"With -t song-position messages are rate-limited: positions within the settle\n"
+"time are coalesced and only the latest one is sent when it has passed.\n"
+"Coalesced messages are reported on stderr once the locate settled.\n"
+"\n"
+"With -n the events of the first output are also sent as RTP-MIDI (AppleMIDI)\n"
+"over UDP by a separate thread. It invites the receiver to a session until\n"
+"it accepts, and keeps the session clocks in sync. Timestamps are derived\n"
+"from the JACK frame time, so the receiver can remove network jitter.\n"
+"Events that are queued while there is no session are discarded and\n"
+"counted on stderr.\n"
+"\n"
+"With -M every event that is sent is also written to a Standard MIDI File\n"
+"(type 0) by a separate thread. Event times are relative to the first event.\n"
+"Clock ticks are placed on the file's beat grid and tempo changes are\n"
+"written as the clock follows them. Every event is on the MIDI tick nearest\n"
+"to its time, so timing is kept to half a tick (ppqn sets the\n"
+"resolution). The file is finalized on exit.\n"
+"\n"
+"When jack freewheels (e.g. during an export), clock is by default sent at\n"
+"transport rate, which is correct for JACK MIDI recorders, but compressed\n"
+"in time for external devices. With '-F mute' nothing is sent while\n"
+"freewheeling. '-F stop' sends 'stop' and the song-position when\n"
+"freewheeling starts and re-syncs when it ends: song-position and, if the\n"
+"transport is rolling, 'continue' on time. With all policies the generator\n"
+"keeps following the transport and the time spent per cycle is reported\n"
+"when freewheeling ends.\n"
+"\n"
+"With -R jack_midi_clock does not connect to jackd, but runs the same clock\n"
+"generator on simulated cycles, as fast as possible, and writes the events\n"
+"to the MIDI file given with -M or as list (sample-time, bytes) to stdout.\n"
+"Transport and tempo are read from a text file, one command per line:\n"
+"  tempo <bar>[|<beat>[|<tick>]] <bpm>    tempo change (default: 120)\n"
+"  meter <bar> <beats>/<type>             meter change (default: 4/4)\n"
+"  start <sec>                            start transport\n"
+"  stop <sec>                             stop transport\n"
+"  locate <sec> <bar>[|<beat>[|<tick>]]   locate transport\n"
+"  freewheel <sec> on|off                 simulate freewheeling (see -F)\n"
+"  end <sec>                              end of rendering (required)\n"
+"Times are seconds since the beginning of the rendering, positions are\n"
+"given in bar|beat|tick (1920 ticks per beat). '#' starts a comment.\n"
+"The time spent per cycle is reported on stderr.\n"
+"\n"
+"When a device is connected to an output while the transport is rolling,\n"
+"only that output is re-synced: the song-position of the next bar is sent,\n"
+"followed by 'continue' just in time. Other devices on the same output\n"
+"receive these messages as well, use -o to give devices that may be\n"
+"(re-)connected mid-song an output of their own.\n"
+"\n"
+"The JACK ports given on the command line are connected to the output.\n"
+"With more than one output they are connected in order: the first to\n"
+"mclk_out_1, the second to mclk_out_2 etc., the last output takes the rest.\n"
+"Each one is a port name or alias, a glob pattern if it contains '*', '?'\n"
+"or '[' (e.g. 'system:midi_playback_*') or an extended regular expression\n"
+"prefixed with 're:'. Ports that match later on (e.g. a USB MIDI interface\n"
+"that is plugged in again) are connected when they appear.\n"
+"\n"
 "jack_midi_clock runs until it receives a HUP or INT signal or jackd is\n"
 "terminated.\n"
 "\n"
@@ -570,12 +2246,30 @@ static int decode_switches (int argc, char **argv) {
   while ((c = getopt_long (argc, argv,
 			   "b:"	/* bpm */
 			   "B"	/* force-bpm */
+			   "F:"	/* freewheel */
+			   "H:"	/* hold */
 			   "d:"	/* resync-delay */
+			   "D:"	/* din */
 			   "J:"	/* jittery output */
+			   "j:"	/* seamless */
+			   "k:"	/* link */
+			   "f:"	/* fps */
+			   "L:"	/* long-position */
 			   "h"	/* help */
+			   "M:"	/* midi-file */
+			   "m:"	/* tempo-map */
+			   "n:"	/* rtp-midi */
 			   "P"	/* no-position */
+			   "o:"	/* outputs */
+			   "p:"	/* period */
+			   "Q:"	/* ppqn */
+			   "r:"	/* samplerate */
+			   "R:"	/* render */
+			   "S:"	/* smooth */
+			   "z:"	/* deadband */
 			   "T"	/* no-transport */
 			   "s"  /* strict-bpm */
+			   "t:"	/* settle */
 			   "V",	/* version */
 			   long_options, (int *) 0)) != EOF)
     {
@@ -588,10 +2282,126 @@ static int decode_switches (int argc, char **argv) {
 	  force_bpm = 1;
 	  break;
 
+	case 'F':
+	  if (!strcmp(optarg, "run")) fw_policy = FW_RUN;
+	  else if (!strcmp(optarg, "mute")) fw_policy = FW_MUTE;
+	  else if (!strcmp(optarg, "stop")) fw_policy = FW_STOP;
+	  else {
+	    fprintf(stderr, "Invalid freewheel policy, should be 'run', 'mute' or 'stop'. Using 'run'.\n");
+	    fw_policy = FW_RUN;
+	  }
+	  break;
+
+	case 'H':
+	  hold_time = atof(optarg);
+	  if (hold_time < 0 || hold_time > 60) {
+	    fprintf(stderr, "Invalid hold time, should be 0 <= sec <= 60. Using 0 (off).\n");
+	    hold_time = 0;
+	  }
+	  break;
+
+	case 'f':
+	  for (tc_rate = 0; tc_rate < 3 && tc_fps[tc_rate] != atoi(optarg); ++tc_rate) ;
+	  if (tc_rate == 3) {
+	    fprintf(stderr, "Invalid frame-rate, should be 24, 25 or 30. Using 25.\n");
+	    tc_rate = 1;
+	  }
+	  break;
+
+	case 'j':
+	  seamless_outputs |= parse_outputs(optarg);
+	  break;
+
+	case 'k':
+#ifdef WITH_LINK
+	  if (!strcmp(optarg, "follow")) link_mode = LINK_FOLLOW;
+	  else if (!strcmp(optarg, "publish")) link_mode = LINK_PUBLISH;
+	  else {
+	    fprintf(stderr, "Invalid Link mode, should be 'follow' or 'publish'. Ignored.\n");
+	  }
+#else
+	  fprintf(stderr, "This version was compiled without support for Ableton Link.\n");
+#endif
+	  break;
+
+	case 'L':
+	  if (!strcmp(optarg, "off")) long_pos = LP_OFF;
+	  else if (!strcmp(optarg, "mtc")) long_pos = LP_MTC;
+	  else if (!strcmp(optarg, "mmc")) long_pos = LP_MMC;
+	  else {
+	    fprintf(stderr, "Invalid long-position mode, should be 'off', 'mtc' or 'mmc'. Using 'off'.\n");
+	    long_pos = LP_OFF;
+	  }
+	  break;
+
+	case 'M':
+	  smf_file = optarg;
+	  break;
+
+	case 'm':
+	  timebase_file = optarg;
+	  break;
+
+	case 'n':
+	  rtp_peer = optarg;
+	  break;
+
 	case 'P':
 	  msg_filter |= MSG_NO_POSITION;
 	  break;
 
+	case 'o':
+	  n_outputs = atoi(optarg);
+	  if (n_outputs < 1 || n_outputs > MAX_OUTPUTS) {
+	    fprintf(stderr, "Invalid number of outputs, should be 1 <= n <= %d. Using 1.\n", MAX_OUTPUTS);
+	    n_outputs = 1;
+	  }
+	  break;
+
+	case 'p':
+	  render_period = atoi(optarg);
+	  if (render_period < 16 || render_period > 8192) {
+	    fprintf(stderr, "Invalid period, should be 16 <= frames <= 8192. Using 1024.\n");
+	    render_period = 1024;
+	  }
+	  break;
+
+	case 'r':
+	  render_rate = atof(optarg);
+	  if (render_rate < 8000 || render_rate > 768000) {
+	    fprintf(stderr, "Invalid samplerate, should be 8000 <= Hz <= 768000. Using 48000.\n");
+	    render_rate = 48000;
+	  }
+	  break;
+
+	case 'R':
+	  render_file = optarg;
+	  break;
+
+	case 'S':
+	  smooth_time = atof(optarg);
+	  if (smooth_time < 0 || smooth_time > 10) {
+	    fprintf(stderr, "Invalid tempo filter time, should be 0 <= sec <= 10. Using 0 (off).\n");
+	    smooth_time = 0;
+	  }
+	  break;
+
+	case 'z':
+	  smooth_deadband = atof(optarg);
+	  if (smooth_deadband < 0 || smooth_deadband > 10) {
+	    fprintf(stderr, "Invalid tempo deadband, should be 0 <= BPM <= 10. Using 0.1.\n");
+	    smooth_deadband = 0.1;
+	  }
+	  break;
+
+	case 'Q':
+	  smf_ppqn = atoi(optarg);
+	  if (smf_ppqn < 24 || smf_ppqn > 32767) {
+	    fprintf(stderr, "Invalid ppqn, should be 24 <= ppqn <= 32767. Using 960.\n");
+	    smf_ppqn = 960;
+	  }
+	  break;
+
 	case 'd':
 	  resync_delay = atof(optarg);
 	  if (resync_delay < 0 || resync_delay > 20) {
@@ -600,6 +2410,10 @@ static int decode_switches (int argc, char **argv) {
 	  }
 	  break;
 
+	case 'D':
+	  din_outputs |= parse_outputs(optarg);
+	  break;
+
 	case 'J':
 #ifdef WITH_JITTER
 	  jitter_level = atof(optarg) / 100.f;
@@ -620,6 +2434,14 @@ static int decode_switches (int argc, char **argv) {
           tempo_is_qnpm = 0;
           break;
 
+	case 't':
+	  spp_settle = atof(optarg);
+	  if (spp_settle < 0 || spp_settle > 10) {
+	    fprintf(stderr, "Invalid settle time, should be 0 <= sec <= 10. Using 0 (off).\n");
+	    spp_settle = 0;
+	  }
+	  break;
+
 	case 'V':
 	  printf ("jack_midi_clock version %s\n\n", VERSION);
 	  printf ("Copyright (C) GPL 2013 Robin Gareus <robin@gareus.org>\n");
@@ -642,10 +2464,30 @@ int main (int argc, char **argv) {
 
   decode_switches (argc, argv);
 
+  if (render_file) {
+    return render(render_file) ? 1 : 0;
+  }
+
+  wake_main_init();
+
   if (init_jack("jack_midi_clock"))
     goto out;
   if (jack_portsetup())
     goto out;
+  if (port_rules_setup(argc, argv))
+    goto out;
+  if (timebase_file && timebase_setup())
+    goto out;
+#ifdef WITH_LINK
+  if (link_mode != LINK_OFF && link_setup())
+    goto out;
+#endif
+
+  if (smf_file && smf_open())
+    goto out;
+
+  if (rtp_peer && rtp_setup())
+    goto out;
 
   if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
     fprintf(stderr, "Warning: Can not lock memory.\n");
@@ -656,8 +2498,8 @@ int main (int argc, char **argv) {
     goto out;
   }
 
-  while (optind < argc)
-    port_connect(argv[optind++]);
+  if (port_rules)
+    autoconnect_scan(port_rules);
 
 #ifndef _WIN32
   signal (SIGHUP, catchsig);
@@ -670,18 +2512,36 @@ int main (int argc, char **argv) {
    if (_rseed == 0) _rseed = 1;
 #endif
 
-  wake_main_init();
-
   /* all systems go.
    * processs() does the work in jack realtime context
    */
   client_state = Run;
   while (client_state != Exit) {
     wake_main_wait();
+    if (fw_ended) {
+      fw_ended = 0;
+      freewheel_report();
+    }
+    report_dropped();
+    report_rtp_dropped(0);
+    report_flywheel();
+    report_coalesced();
+    report_din();
+    if (port_rules)
+      autoconnect_poll(port_rules);
   }
 
 out:
   cleanup(0);
+  autoconnect_free(port_rules);
+  report_rtp_dropped(1);
+  rtpmidi_close(rtp_out);
+#ifdef WITH_LINK
+  link_close();
+#endif
+  smf_close();
+  report_dropped();
+  tempomap_free(&timebase_map);
   return(0);
 }
 
@@ -694,7 +2554,7 @@ int jack_initialize(jack_client_t* client, const char* load_init) {
   // TODO parse load_init
 
   j_client = client;
-  jack_set_process_callback (client, process, 0);
+  jack_callbacks (client);
 
   if (jack_portsetup())
     return(1);
@@ -0,0 +1,473 @@
+/* RTP-MIDI (AppleMIDI) output for jack_midi_clock
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+
+#include "rtpmidi.h"
+
+#define RTP_QUEUE_SIZE (1024)          ///< pending events
+#define RTP_MAX_LIST (1024)            ///< max MIDI command list per packet [bytes]
+#define RTP_HEADER (12)
+#define RTP_INVITE_INTERVAL (1000000)  ///< usec between invitations
+#define RTP_SYNC_INTERVAL (10000000)   ///< usec between clock syncs
+#define RTP_SYNC_INITIAL (6)           ///< syncs 1 sec apart after the session started
+#define RTP_SYNC_TIMEOUT (3 * RTP_SYNC_INTERVAL) ///< re-invite if the peer does not answer
+
+enum {
+  RTP_INVITE_CTRL = 0, ///< invite on the control port (index of the socket)
+  RTP_INVITE_DATA,     ///< invite on the data port
+  RTP_SESSION
+};
+
+typedef struct {
+  jack_time_t usec;
+  uint8_t     size;
+  uint8_t     data[RTPMIDI_MAX_EVENT_SIZE];
+} rtp_event;
+
+struct rtpmidi {
+  int                     fd[2];   ///< control, data socket
+  struct sockaddr_storage peer[2]; ///< control, data port of the peer
+  socklen_t               peer_len;
+  char                   *name;
+  uint32_t                ssrc;
+  uint32_t                token;
+  uint16_t                seq;
+  int                     state;   ///< RTP_*
+  jack_time_t             next_invite;
+  jack_time_t             next_sync;
+  jack_time_t             last_sync; ///< last answer of the peer
+  int                     n_sync;
+  short                   declined;
+  jack_ringbuffer_t      *queue;   ///< rtp_event
+  int                     wake[2]; ///< pipe, written when events were queued
+  short                   wake_pending; ///< a wake-up byte is in the pipe
+  uint32_t                dropped;
+  pthread_t               thread;
+  volatile short          run;
+};
+
+static void put16 (uint8_t *p, uint16_t v) {
+  p[0] = v >> 8; p[1] = v;
+}
+
+static void put32 (uint8_t *p, uint32_t v) {
+  put16(p, v >> 16); put16(p + 2, v);
+}
+
+static void put64 (uint8_t *p, uint64_t v) {
+  put32(p, v >> 32); put32(p + 4, v);
+}
+
+static uint32_t get32 (const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t get64 (const uint8_t *p) {
+  return ((uint64_t) get32(p) << 32) | get32(p + 4);
+}
+
+/**
+ * session clock, 100 usec units
+ */
+static uint64_t rtp_now (void) {
+  return jack_get_time() / 100;
+}
+
+static void set_port (struct sockaddr_storage *sa, int port) {
+  if (sa->ss_family == AF_INET6) {
+    ((struct sockaddr_in6*) sa)->sin6_port = htons(port);
+  } else {
+    ((struct sockaddr_in*) sa)->sin_port = htons(port);
+  }
+}
+
+static int get_port (const struct sockaddr_storage *sa) {
+  if (sa->ss_family == AF_INET6) {
+    return ntohs(((const struct sockaddr_in6*) sa)->sin6_port);
+  }
+  return ntohs(((const struct sockaddr_in*) sa)->sin_port);
+}
+
+static void rtp_send_to (rtpmidi *r, int sock, const uint8_t *buf, size_t len) {
+  (void) sendto(r->fd[sock], buf, len, 0, (const struct sockaddr*) &r->peer[sock], r->peer_len);
+}
+
+/**
+ * AppleMIDI invitation (IN) or end of session (BY)
+ */
+static void rtp_session_cmd (rtpmidi *r, int sock, const char *cmd) {
+  uint8_t buf[16 + 64];
+  size_t len = 16;
+  buf[0] = buf[1] = 0xff;
+  buf[2] = cmd[0];
+  buf[3] = cmd[1];
+  put32(buf + 4, 2); // protocol version
+  put32(buf + 8, r->token);
+  put32(buf + 12, r->ssrc);
+  if (cmd[0] == 'I') {
+    const size_t n = strlen(r->name);
+    memcpy(buf + 16, r->name, n + 1);
+    len += n + 1;
+  }
+  rtp_send_to(r, sock, buf, len);
+}
+
+/**
+ * AppleMIDI clock synchronization (CK), on the data port
+ */
+static void rtp_sync (rtpmidi *r, uint8_t count, uint64_t ts1, uint64_t ts2, uint64_t ts3) {
+  uint8_t buf[36];
+  memset(buf, 0, sizeof(buf));
+  buf[0] = buf[1] = 0xff;
+  buf[2] = 'C';
+  buf[3] = 'K';
+  put32(buf + 4, r->ssrc);
+  buf[8] = count;
+  put64(buf + 12, ts1);
+  put64(buf + 20, ts2);
+  put64(buf + 28, ts3);
+  rtp_send_to(r, RTP_INVITE_DATA, buf, sizeof(buf));
+}
+
+static void rtp_restart (rtpmidi *r, jack_time_t now) {
+  r->state = RTP_INVITE_CTRL;
+  r->next_invite = now + RTP_INVITE_INTERVAL;
+  r->token = rand();
+}
+
+/**
+ * handle an AppleMIDI command from the peer
+ */
+static void rtp_receive (rtpmidi *r, int sock, const uint8_t *buf, ssize_t len) {
+  const jack_time_t now = jack_get_time();
+  if (len < 4 || buf[0] != 0xff || buf[1] != 0xff) {
+    return; // RTP from the peer, not interested
+  }
+  if (!memcmp(buf + 2, "OK", 2) && len >= 16) {
+    if (get32(buf + 8) != r->token || r->state != sock) {
+      return;
+    }
+    if (sock == RTP_INVITE_CTRL) {
+      r->state = RTP_INVITE_DATA;
+      r->next_invite = now;
+    } else {
+      r->state = RTP_SESSION;
+      r->n_sync = 0;
+      r->next_sync = now;
+      r->last_sync = now;
+      r->declined = 0;
+      fprintf(stderr, "RTP-MIDI: session with '%.*s' started\n", (int) (len - 16), buf + 16);
+    }
+  }
+  else if (!memcmp(buf + 2, "NO", 2)) {
+    if (!r->declined) {
+      fprintf(stderr, "RTP-MIDI: invitation declined, retrying\n");
+    }
+    r->declined = 1;
+    rtp_restart(r, now);
+  }
+  else if (!memcmp(buf + 2, "BY", 2)) {
+    if (r->state == RTP_SESSION) {
+      fprintf(stderr, "RTP-MIDI: session ended by the peer\n");
+    }
+    rtp_restart(r, now);
+  }
+  else if (!memcmp(buf + 2, "CK", 2) && len >= 36 && r->state == RTP_SESSION) {
+    r->last_sync = now;
+    if (buf[8] == 0) {
+      rtp_sync(r, 1, get64(buf + 12), rtp_now(), 0);
+    } else if (buf[8] == 1) {
+      rtp_sync(r, 2, get64(buf + 12), get64(buf + 20), rtp_now());
+    }
+  }
+}
+
+/**
+ * send events as one RTP-MIDI packet, no recovery journal.
+ * The first command is at the RTP timestamp, every further one has
+ * a delta time to its predecessor.
+ */
+static void rtp_send_events (rtpmidi *r, const rtp_event *ev, int n) {
+  uint8_t pkt[RTP_HEADER + 2 + RTP_MAX_LIST];
+  uint8_t *list = pkt + RTP_HEADER + 2;
+  uint64_t prev = ev[0].usec / 100;
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    if (i > 0) {
+      const uint64_t t = ev[i].usec / 100;
+      const uint32_t dt = t > prev ? t - prev : 0;
+      if (dt >= (1 << 21)) list[len++] = 0x80 | ((dt >> 21) & 0x7f);
+      if (dt >= (1 << 14)) list[len++] = 0x80 | ((dt >> 14) & 0x7f);
+      if (dt >= (1 << 7))  list[len++] = 0x80 | ((dt >> 7) & 0x7f);
+      list[len++] = dt & 0x7f;
+      prev = t;
+    }
+    memcpy(list + len, ev[i].data, ev[i].size);
+    len += ev[i].size;
+  }
+
+  pkt[0] = 0x80; // version 2
+  pkt[1] = 0x61; // payload type 97
+  put16(pkt + 2, r->seq++);
+  put32(pkt + 4, ev[0].usec / 100);
+  put32(pkt + 8, r->ssrc);
+  if (len < 16) {
+    /* short header: B=0 J=0 Z=0 P=0 LEN */
+    pkt[RTP_HEADER] = len;
+    memmove(pkt + RTP_HEADER + 1, list, len);
+    len += RTP_HEADER + 1;
+  } else {
+    /* long header: B=1, 12 bit LEN */
+    pkt[RTP_HEADER] = 0x80 | (len >> 8);
+    pkt[RTP_HEADER + 1] = len & 0xff;
+    len += RTP_HEADER + 2;
+  }
+  rtp_send_to(r, RTP_INVITE_DATA, pkt, len);
+}
+
+/**
+ * send or discard queued events, packets hold as many as fit
+ */
+static void rtp_drain (rtpmidi *r) {
+  rtp_event ev[RTP_MAX_LIST / 4];
+  size_t bytes = 0;
+  int n = 0;
+
+  while (jack_ringbuffer_read_space(r->queue) >= sizeof(rtp_event)) {
+    rtp_event *e = &ev[n];
+    jack_ringbuffer_read(r->queue, (char*) e, sizeof(rtp_event));
+    if (r->state != RTP_SESSION) {
+      __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    bytes += e->size + 4; // 4: max delta time
+    if (++n == RTP_MAX_LIST / 4 || bytes + RTPMIDI_MAX_EVENT_SIZE + 4 > RTP_MAX_LIST) {
+      rtp_send_events(r, ev, n);
+      n = 0;
+      bytes = 0;
+    }
+  }
+  if (n > 0) {
+    rtp_send_events(r, ev, n);
+  }
+}
+
+/**
+ * wake the sender thread, at most one byte is pending
+ */
+static void rtp_wake (rtpmidi *r) {
+  const char c = 0;
+  if (!__atomic_exchange_n(&r->wake_pending, 1, __ATOMIC_ACQ_REL)) {
+    (void) write(r->wake[1], &c, sizeof(c));
+  }
+}
+
+static void *rtp_thread (void *arg) {
+  rtpmidi *r = (rtpmidi*) arg;
+  struct pollfd pfd[3];
+  uint8_t buf[512];
+  int i;
+
+  pfd[0].fd = r->fd[0];
+  pfd[1].fd = r->fd[1];
+  pfd[2].fd = r->wake[0];
+  pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+
+  while (r->run) {
+    jack_time_t now = jack_get_time();
+    jack_time_t due;
+
+    if (r->state != RTP_SESSION && now >= r->next_invite) {
+      rtp_session_cmd(r, r->state, "IN");
+      r->next_invite = now + RTP_INVITE_INTERVAL;
+    }
+    if (r->state == RTP_SESSION && now >= r->next_sync) {
+      if (now - r->last_sync > RTP_SYNC_TIMEOUT) {
+	fprintf(stderr, "RTP-MIDI: peer does not respond, re-inviting\n");
+	rtp_restart(r, now);
+      } else {
+	rtp_sync(r, 0, rtp_now(), 0, 0);
+	r->next_sync = now + (r->n_sync++ < RTP_SYNC_INITIAL ? 1000000 : RTP_SYNC_INTERVAL);
+      }
+    }
+
+    /* sleep until a packet arrives, events are queued or the next
+     * invitation or clock sync is due */
+    due = r->state == RTP_SESSION ? r->next_sync : r->next_invite;
+    now = jack_get_time();
+    if (poll(pfd, 3, due > now ? (due - now + 999) / 1000 : 0) > 0) {
+      for (i = 0; i < 2; ++i) {
+	if (pfd[i].revents & POLLIN) {
+	  const ssize_t len = recv(r->fd[i], buf, sizeof(buf), 0);
+	  rtp_receive(r, i, buf, len);
+	}
+      }
+      if (pfd[2].revents & POLLIN) {
+	__atomic_store_n(&r->wake_pending, 0, __ATOMIC_RELEASE);
+	(void) read(r->wake[0], buf, sizeof(buf));
+      }
+    }
+    rtp_drain(r);
+  }
+
+  if (r->state != RTP_INVITE_CTRL) {
+    rtp_session_cmd(r, RTP_INVITE_CTRL, "BY");
+  }
+  return NULL;
+}
+
+/**
+ * bind the control socket to a free port and the data socket to the next one
+ */
+static int rtp_bind (rtpmidi *r, int family) {
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  int attempt;
+
+  for (attempt = 0; attempt < 16; ++attempt) {
+    memset(&sa, 0, sizeof(sa));
+    sa.ss_family = family;
+    if ((r->fd[0] = socket(family, SOCK_DGRAM, 0)) < 0 || (r->fd[1] = socket(family, SOCK_DGRAM, 0)) < 0) {
+      return -1;
+    }
+    len = family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    if (!bind(r->fd[0], (struct sockaddr*) &sa, len)
+	&& !getsockname(r->fd[0], (struct sockaddr*) &sa, &len)) {
+      set_port(&sa, get_port(&sa) + 1);
+      if (!bind(r->fd[1], (struct sockaddr*) &sa, len)) {
+	return 0;
+      }
+    }
+    close(r->fd[0]);
+    close(r->fd[1]);
+    r->fd[0] = r->fd[1] = -1;
+  }
+  return -1;
+}
+
+rtpmidi *rtpmidi_open (const char *host, int port, const char *name) {
+  struct addrinfo hints, *res = NULL;
+  rtpmidi *r;
+  int err;
+
+  if (!(r = (rtpmidi*) calloc(1, sizeof(rtpmidi)))) {
+    return NULL;
+  }
+  r->fd[0] = r->fd[1] = -1;
+  r->wake[0] = r->wake[1] = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((err = getaddrinfo(host, NULL, &hints, &res))) {
+    fprintf(stderr, "RTP-MIDI: cannot resolve '%s': %s\n", host, gai_strerror(err));
+    free(r);
+    return NULL;
+  }
+  memcpy(&r->peer[0], res->ai_addr, res->ai_addrlen);
+  memcpy(&r->peer[1], res->ai_addr, res->ai_addrlen);
+  r->peer_len = res->ai_addrlen;
+  set_port(&r->peer[0], port);
+  set_port(&r->peer[1], port + 1);
+
+  if (rtp_bind(r, res->ai_family)) {
+    fprintf(stderr, "RTP-MIDI: cannot create sockets\n");
+    freeaddrinfo(res);
+    rtpmidi_close(r);
+    return NULL;
+  }
+  freeaddrinfo(res);
+
+  srand(jack_get_time() ^ getpid());
+  r->name = strndup(name, 63);
+  r->ssrc = rand();
+  r->seq = rand();
+  r->token = rand();
+  r->state = RTP_INVITE_CTRL;
+  r->queue = jack_ringbuffer_create(RTP_QUEUE_SIZE * sizeof(rtp_event));
+  if (pipe(r->wake)) {
+    r->wake[0] = r->wake[1] = -1;
+  } else {
+    fcntl(r->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(r->wake[1], F_SETFL, O_NONBLOCK);
+  }
+  r->run = 1;
+  if (!r->name || !r->queue || r->wake[0] < 0 || pthread_create(&r->thread, NULL, rtp_thread, r)) {
+    fprintf(stderr, "RTP-MIDI: cannot start sender\n");
+    r->run = 0;
+    rtpmidi_close(r);
+    return NULL;
+  }
+  return r;
+}
+
+int rtpmidi_send (rtpmidi *r, jack_time_t usec, const uint8_t *data, size_t size) {
+  rtp_event e;
+  if (size > RTPMIDI_MAX_EVENT_SIZE || jack_ringbuffer_write_space(r->queue) < sizeof(rtp_event)) {
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  e.usec = usec;
+  e.size = size;
+  memcpy(e.data, data, size);
+  jack_ringbuffer_write(r->queue, (const char*) &e, sizeof(rtp_event));
+  rtp_wake(r);
+  return 0;
+}
+
+uint32_t rtpmidi_dropped (rtpmidi *r) {
+  return __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+}
+
+void rtpmidi_close (rtpmidi *r) {
+  if (!r) {
+    return;
+  }
+  if (r->run) {
+    r->run = 0;
+    __atomic_store_n(&r->wake_pending, 0, __ATOMIC_RELEASE);
+    rtp_wake(r);
+    pthread_join(r->thread, NULL);
+  }
+  if (r->fd[0] >= 0) close(r->fd[0]);
+  if (r->fd[1] >= 0) close(r->fd[1]);
+  if (r->wake[0] >= 0) close(r->wake[0]);
+  if (r->wake[1] >= 0) close(r->wake[1]);
+  if (r->queue) {
+    jack_ringbuffer_free(r->queue);
+  }
+  free(r->name);
+  free(r);
+}
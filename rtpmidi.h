@@ -0,0 +1,64 @@
+/* RTP-MIDI (AppleMIDI) output for jack_midi_clock
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef RTPMIDI_H
+#define RTPMIDI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <jack/jack.h>
+
+#define RTPMIDI_PORT (5004)          ///< default AppleMIDI control port
+#define RTPMIDI_MAX_EVENT_SIZE (16)
+
+typedef struct rtpmidi rtpmidi;
+
+/**
+ * start a sender thread that invites the given peer to an AppleMIDI
+ * session (control port, data port = control port + 1), keeps the
+ * clocks in sync and sends queued events. The invitation is repeated
+ * until the peer accepts and after it ended the session.
+ * @param host peer host name or address
+ * @param port peer control port
+ * @param name session name
+ * @return NULL on error (a message is printed)
+ */
+rtpmidi *rtpmidi_open (const char *host, int port, const char *name);
+
+/**
+ * queue an event, realtime safe.
+ * @param usec time the event is due, jack microseconds (see
+ *        jack_frames_to_time(), jack_get_time()); RTP timestamps
+ *        are derived from it in 100 usec units.
+ * @return 0 on success, -1 if the queue is full or the event too long
+ */
+int rtpmidi_send (rtpmidi *r, jack_time_t usec, const uint8_t *data, size_t size);
+
+/**
+ * events queued while there was no session or the queue was full
+ */
+uint32_t rtpmidi_dropped (rtpmidi *r);
+
+/**
+ * end the session, stop the thread and free r
+ */
+void rtpmidi_close (rtpmidi *r);
+
+#endif
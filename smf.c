@@ -0,0 +1,482 @@
+/* Standard MIDI File support for jack_midi_clock tools
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "smf.h"
+
+#define TEMPO_TOLERANCE (0.5)     ///< [ticks] deviation of a clock tick on the beat grid from its time
+#define MAX_CLOCK_INTERVAL (0.25) ///< [sec] longer gaps between clock ticks are not a tempo (10 BPM)
+
+/* tempo-map, used to convert ticks to samples */
+struct tempo_change {
+  uint64_t tick;   ///< position of tempo change in MIDI ticks
+  double   sample; ///< position of tempo change in audio samples
+  double   spt;    ///< samples per tick
+};
+
+struct smf_reader {
+  const uint8_t *buf;
+  size_t len;
+  int ppqn;       ///< 0 for SMPTE time
+  double spt;     ///< samples per tick for SMPTE time
+  double samplerate;
+  struct tempo_change *tmap;
+  int ntempo;
+  int nalloc;
+  int cur;        ///< tempo-map index of the previous event, events are in order
+};
+
+static uint32_t read_be32(const uint8_t *d) {
+  return ((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16) | ((uint32_t)d[2] << 8) | d[3];
+}
+
+static uint16_t read_be16(const uint8_t *d) {
+  return (d[0] << 8) | d[1];
+}
+
+/**
+ * read variable-length quantity
+ * @return -1 on error
+ */
+static int64_t read_vlq(const uint8_t *d, size_t len, size_t *pos) {
+  int64_t v = 0;
+  int i;
+  for (i = 0; i < 4; ++i) {
+    if (*pos >= len) return -1;
+    v = (v << 7) | (d[*pos] & 0x7f);
+    if (!(d[(*pos)++] & 0x80)) return v;
+  }
+  return -1;
+}
+
+/**
+ * convert MIDI tick to audio sample using the tempo map
+ */
+static uint64_t tick_to_sample(struct smf_reader *r, uint64_t tick) {
+  int i = r->cur;
+  if (r->ppqn == 0) {
+    return llrint(tick * r->spt);
+  }
+  while (i + 1 < r->ntempo && r->tmap[i + 1].tick <= tick) ++i;
+  while (i > 0 && r->tmap[i].tick > tick) --i;
+  r->cur = i;
+  return llrint(r->tmap[i].sample + (tick - r->tmap[i].tick) * r->tmap[i].spt);
+}
+
+/**
+ * @return -1 if the tempo-map cannot grow
+ */
+static int add_tempo(struct smf_reader *r, uint64_t tick, uint32_t us_per_qn) {
+  struct tempo_change *prev;
+  if (r->ppqn == 0) return 0;
+  /* the map is built from the first track, which is in order */
+  prev = &r->tmap[r->ntempo - 1];
+  if (prev->tick == tick) {
+    prev->spt = us_per_qn * 1e-6 * r->samplerate / r->ppqn;
+    return 0;
+  }
+  if (r->ntempo >= r->nalloc) {
+    struct tempo_change *t;
+    if (!(t = (struct tempo_change*) realloc(r->tmap, 2 * r->nalloc * sizeof(struct tempo_change)))) return -1;
+    r->tmap = t;
+    r->nalloc *= 2;
+    prev = &r->tmap[r->ntempo - 1];
+  }
+  r->tmap[r->ntempo].tick   = tick;
+  r->tmap[r->ntempo].sample = prev->sample + (tick - prev->tick) * prev->spt;
+  r->tmap[r->ntempo].spt    = us_per_qn * 1e-6 * r->samplerate / r->ppqn;
+  r->ntempo++;
+  return 0;
+}
+
+/**
+ * parse a single track
+ * @param tempo_only only collect the tempo-map, do not report events
+ */
+static int parse_track(struct smf_reader *r, const uint8_t *d, size_t len, int track, int tempo_only, smf_event_cb cb, void *arg) {
+  uint64_t tick = 0;
+  uint8_t status = 0;
+  size_t pos = 0;
+
+  r->cur = 0;
+
+  while (pos < len) {
+    int64_t delta = read_vlq(d, len, &pos);
+    if (delta < 0 || pos >= len) return -1;
+    tick += delta;
+
+    if (d[pos] == 0xff) {
+      /* meta event */
+      int64_t mlen;
+      uint8_t type;
+      if (pos + 2 > len) return -1;
+      type = d[pos + 1];
+      pos += 2;
+      if ((mlen = read_vlq(d, len, &pos)) < 0 || pos + mlen > len) return -1;
+      if (type == 0x51 && mlen == 3 && tempo_only) {
+	if (add_tempo(r, tick, (d[pos] << 16) | (d[pos + 1] << 8) | d[pos + 2])) return -1;
+      }
+      pos += mlen;
+      if (type == 0x2f) break; // end of track
+      continue;
+    }
+
+    if (d[pos] == 0xf0 || d[pos] == 0xf7) {
+      /* sysex or escaped message */
+      const uint8_t type = d[pos++];
+      int64_t mlen = read_vlq(d, len, &pos);
+      if (mlen < 0 || pos + mlen > len) return -1;
+      if (!tempo_only && mlen > 0) {
+	if (type == 0xf0) {
+	  uint8_t *sysex = (uint8_t*) malloc(mlen + 1);
+	  if (sysex) {
+	    sysex[0] = 0xf0;
+	    memcpy(&sysex[1], &d[pos], mlen);
+	    cb(arg, track, tick_to_sample(r, tick), sysex, mlen + 1);
+	    free(sysex);
+	  }
+	} else {
+	  cb(arg, track, tick_to_sample(r, tick), &d[pos], mlen);
+	}
+      }
+      pos += mlen;
+      status = 0; // cancel running status
+      continue;
+    }
+
+    /* channel message, possibly w/running status */
+    if (d[pos] & 0x80) {
+      status = d[pos++];
+    }
+    if (!status) return -1;
+    {
+      const size_t mlen = ((status & 0xe0) == 0xc0) ? 1 : 2;
+      uint8_t msg[3];
+      if (pos + mlen > len) return -1;
+      msg[0] = status;
+      memcpy(&msg[1], &d[pos], mlen);
+      if (!tempo_only) {
+	cb(arg, track, tick_to_sample(r, tick), msg, mlen + 1);
+      }
+      pos += mlen;
+    }
+  }
+  return 0;
+}
+
+int smf_read (const char *fn, double samplerate, smf_event_cb cb, void *arg) {
+  struct smf_reader r;
+  uint8_t *buf = NULL;
+  size_t pos;
+  long flen;
+  int ntracks, division, t;
+  int rv = -1;
+  FILE *f;
+
+  if (!(f = fopen(fn, "rb"))) {
+    return -1;
+  }
+  if (fseek(f, 0, SEEK_END) || (flen = ftell(f)) < 14 || fseek(f, 0, SEEK_SET)) {
+    fclose(f);
+    return -1;
+  }
+  buf = (uint8_t*) malloc(flen);
+  if (!buf || fread(buf, 1, flen, f) != (size_t) flen) {
+    free(buf);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  memset(&r, 0, sizeof(struct smf_reader));
+  r.buf = buf;
+  r.len = flen;
+  r.samplerate = samplerate;
+
+  if (memcmp(buf, "MThd", 4) || read_be32(&buf[4]) < 6) {
+    goto out;
+  }
+  ntracks  = read_be16(&buf[10]);
+  division = read_be16(&buf[12]);
+
+  if (division & 0x8000) {
+    /* SMPTE: -frames per second, ticks per frame */
+    const int fps = -(int8_t)(division >> 8);
+    const int tpf = division & 0xff;
+    if (fps <= 0 || tpf == 0) goto out;
+    r.spt = samplerate / ((fps == 29 ? 29.97 : fps) * tpf);
+  } else {
+    if (division == 0) goto out;
+    r.ppqn = division;
+    r.nalloc = 64;
+    r.tmap = (struct tempo_change*) malloc(r.nalloc * sizeof(struct tempo_change));
+    if (!r.tmap) goto out;
+    /* default tempo: 120 BPM */
+    r.tmap[0].tick   = 0;
+    r.tmap[0].sample = 0;
+    r.tmap[0].spt    = 0.5 * samplerate / r.ppqn;
+    r.ntempo = 1;
+  }
+
+  /* two passes: collect tempo-map from the first track, then events */
+  for (t = 0; t < 2; ++t) {
+    int track = 0;
+    pos = 8 + read_be32(&buf[4]);
+    while (pos + 8 <= r.len && track < (t == 0 ? 1 : ntracks)) {
+      const uint32_t clen = read_be32(&buf[pos + 4]);
+      if (pos + 8 + clen > r.len) goto out;
+      if (!memcmp(&buf[pos], "MTrk", 4)) {
+	if (parse_track(&r, &buf[pos + 8], clen, track, t == 0, cb, arg)) goto out;
+	++track;
+      }
+      pos += 8 + clen;
+    }
+  }
+  rv = 0;
+
+out:
+  free(r.tmap);
+  free(buf);
+  return rv;
+}
+
+/* Standard MIDI File writer */
+
+struct smf_writer {
+  FILE *f;
+  long trk_start;   ///< file offset of the first track event
+  double samplerate;
+  int ppqn;
+  uint64_t t0;      ///< sample time of the first event
+  double spt;       ///< samples per MIDI tick at the tempo written last
+  double anchor_time; ///< time of the last tempo change in samples since t0, as read back
+  uint64_t anchor_tick; ///< position of the last tempo change in MIDI ticks
+  double last_time; ///< time of the previous event in samples since t0
+  double grid;      ///< beat grid position of the previous clock tick, not rounded
+  uint64_t tick;    ///< time of the previous event in MIDI ticks
+  int started;
+  int clock_run;    ///< the previous event was a MIDI clock tick
+};
+
+static void write_be32(FILE *f, uint32_t v) {
+  fputc((v >> 24) & 0xff, f);
+  fputc((v >> 16) & 0xff, f);
+  fputc((v >> 8) & 0xff, f);
+  fputc(v & 0xff, f);
+}
+
+static void write_be16(FILE *f, uint16_t v) {
+  fputc((v >> 8) & 0xff, f);
+  fputc(v & 0xff, f);
+}
+
+/**
+ * write variable-length quantity, v < 2^28
+ */
+static void write_vlq(FILE *f, uint32_t v) {
+  uint8_t b[4];
+  int n = 0;
+  do {
+    b[n++] = v & 0x7f;
+    v >>= 7;
+  } while (v > 0 && n < 4);
+  while (n > 1) {
+    fputc(b[--n] | 0x80, f);
+  }
+  fputc(b[0], f);
+}
+
+/**
+ * write delta time, long gaps are bridged with empty text meta-events
+ */
+static void write_delta(FILE *f, uint64_t delta) {
+  while (delta > 0x0fffffff) {
+    write_vlq(f, 0x0fffffff);
+    fputc(0xff, f); fputc(0x01, f); fputc(0x00, f);
+    delta -= 0x0fffffff;
+  }
+  write_vlq(f, delta);
+}
+
+/**
+ * write a tempo meta-event at the current position
+ */
+static void write_tempo(smf_writer *w, uint32_t us_per_qn) {
+  write_delta(w->f, 0);
+  fputc(0xff, w->f); fputc(0x51, w->f); fputc(0x03, w->f);
+  fputc((us_per_qn >> 16) & 0xff, w->f);
+  fputc((us_per_qn >> 8) & 0xff, w->f);
+  fputc(us_per_qn & 0xff, w->f);
+}
+
+/**
+ * time of a MIDI tick in samples since the first event,
+ * as a reader of the file computes it
+ */
+static double tick_time(smf_writer *w, uint64_t tick) {
+  return w->anchor_time + ((double) tick - (double) w->anchor_tick) * w->spt;
+}
+
+/**
+ * MIDI tick nearest to the given time, not before the previous event
+ */
+static uint64_t nearest_tick(smf_writer *w, double time) {
+  const double t = w->anchor_tick + (time - w->anchor_time) / w->spt;
+  return t > w->tick ? (uint64_t) llrint(t) : w->tick;
+}
+
+/**
+ * set the tempo from the given samples per MIDI tick, starting at the
+ * previous event. The rounded tempo is used from here on so that
+ * event positions match what a reader of the file computes.
+ */
+static void set_tempo(smf_writer *w, double spt) {
+  long us_per_qn = lrint(spt * w->ppqn * 1e6 / w->samplerate);
+  if (us_per_qn < 1) us_per_qn = 1;
+  if (us_per_qn > 0xffffff) us_per_qn = 0xffffff;
+  write_tempo(w, us_per_qn);
+  w->anchor_time = tick_time(w, w->tick);
+  w->anchor_tick = w->tick;
+  w->spt = us_per_qn * 1e-6 * w->samplerate / w->ppqn;
+}
+
+smf_writer *smf_writer_open (const char *fn, double samplerate, int ppqn) {
+  smf_writer *w;
+
+  if (ppqn < 1 || ppqn > 0x7fff || samplerate <= 0) {
+    return NULL;
+  }
+
+  w = (smf_writer*) calloc(1, sizeof(smf_writer));
+  if (!w) return NULL;
+  if (!(w->f = fopen(fn, "wb"))) {
+    free(w);
+    return NULL;
+  }
+  w->samplerate = samplerate;
+  w->ppqn = ppqn;
+
+  fwrite("MThd", 1, 4, w->f);
+  write_be32(w->f, 6);
+  write_be16(w->f, 0); // type 0
+  write_be16(w->f, 1); // one track
+  write_be16(w->f, ppqn);
+
+  fwrite("MTrk", 1, 4, w->f);
+  write_be32(w->f, 0); // length, updated on close
+  w->trk_start = ftell(w->f);
+
+  /* 120 BPM until the clock tells otherwise */
+  w->spt = 0.5 * samplerate / ppqn;
+  set_tempo(w, w->spt);
+
+  return w;
+}
+
+int smf_writer_event (smf_writer *w, uint64_t time, const uint8_t *data, size_t size) {
+  const int is_clock = (size == 1 && data[0] == 0xf8);
+  double t;
+  uint64_t tick = 0;
+  int on_grid = 0;
+
+  if (size == 0 || size > 0x0fffffff || !(data[0] & 0x80)) {
+    return -1;
+  }
+  if (!w->started) {
+    w->t0 = time;
+    w->started = 1;
+  }
+  t = time > w->t0 ? (double) (time - w->t0) : 0;
+
+  if (is_clock && w->clock_run && t - w->last_time <= MAX_CLOCK_INTERVAL * w->samplerate) {
+    /* consecutive clock ticks are on the beat grid, 24 per quarter note.
+     * When the tick nearest to the event's time is off the grid, the
+     * tempo changes at the previous tick: to the clock interval, or if
+     * that is still off the grid, to the tempo that ends on time. */
+    tick = llrint(w->grid + w->ppqn / 24.0);
+    if (tick > w->tick && fabs(tick_time(w, tick) - t) > TEMPO_TOLERANCE * w->spt) {
+      const double prev = tick_time(w, w->tick);
+      double spt = (t - w->last_time) / (tick - w->tick);
+      if (fabs(prev + (tick - w->tick) * spt - t) > TEMPO_TOLERANCE * spt) {
+	spt = (t - prev) / (tick - w->tick);
+      }
+      if (spt > 0) {
+	set_tempo(w, spt);
+      }
+    }
+    on_grid = tick > w->tick && fabs(tick_time(w, tick) - t) <= TEMPO_TOLERANCE * w->spt;
+  }
+  if (on_grid) {
+    w->grid += w->ppqn / 24.0;
+  } else {
+    /* other events, and clock after a gap, are placed at the current tempo */
+    tick = nearest_tick(w, t);
+    if (is_clock) {
+      w->grid = tick;
+    }
+  }
+  w->clock_run = is_clock;
+  w->last_time = t;
+
+  write_delta(w->f, tick - w->tick);
+  w->tick = tick;
+
+  if (data[0] == 0xf0) {
+    /* sysex: length excludes the leading 0xf0 */
+    fputc(0xf0, w->f);
+    write_vlq(w->f, size - 1);
+    fwrite(&data[1], 1, size - 1, w->f);
+  } else if (data[0] > 0xf0) {
+    /* System Common and Real-Time messages are escaped */
+    fputc(0xf7, w->f);
+    write_vlq(w->f, size);
+    fwrite(data, 1, size, w->f);
+  } else {
+    fwrite(data, 1, size, w->f);
+  }
+  return ferror(w->f) ? -1 : 0;
+}
+
+int smf_writer_close (smf_writer *w) {
+  long end;
+  int rv;
+
+  /* end of track */
+  write_vlq(w->f, 0);
+  fputc(0xff, w->f); fputc(0x2f, w->f); fputc(0x00, w->f);
+
+  end = ftell(w->f);
+  rv = (end < 0 || fseek(w->f, w->trk_start - 4, SEEK_SET)) ? -1 : 0;
+  if (rv == 0) {
+    write_be32(w->f, end - w->trk_start);
+  }
+  if (ferror(w->f)) {
+    rv = -1;
+  }
+  if (fclose(w->f)) {
+    rv = -1;
+  }
+  free(w);
+  return rv;
+}
@@ -0,0 +1,76 @@
+/* Standard MIDI File support for jack_midi_clock tools
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef SMF_H
+#define SMF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * callback for every MIDI event read from a file
+ * @param arg user data
+ * @param track track number (0 based)
+ * @param time event time in audio samples
+ * @param data MIDI message, System Real-Time and Common messages
+ *        stored as escaped (0xf7) events are unwrapped.
+ * @param size number of bytes in data
+ */
+typedef void (*smf_event_cb) (void *arg, int track, uint64_t time, const uint8_t *data, size_t size);
+
+/**
+ * parse a Standard MIDI File (type 0 or 1)
+ * tempo map meta-events are honored to convert
+ * MIDI ticks to audio samples.
+ * @param samplerate used to convert time to samples
+ * @return 0 on success, -1 on error
+ */
+int smf_read (const char *fn, double samplerate, smf_event_cb cb, void *arg);
+
+typedef struct smf_writer smf_writer;
+
+/**
+ * create a Standard MIDI File (type 0) for writing.
+ * The file's tempo follows the MIDI clock that is written to it:
+ * consecutive clock ticks are placed on the beat grid (24 per quarter
+ * note) and a tempo meta-event is added whenever a grid position is not
+ * the MIDI tick nearest to the tick's time. Every event is on the MIDI
+ * tick nearest to its time, smf_read() returns it within half a tick.
+ * Until the clock runs, the tempo is 120 BPM.
+ * @param ppqn pulses (ticks) per quarter note, 1..32767
+ * @return NULL on error
+ */
+smf_writer *smf_writer_open (const char *fn, double samplerate, int ppqn);
+
+/**
+ * append an event. Times are in audio samples, relative to the
+ * first event written. System Common and Real-Time messages are
+ * stored as escaped (0xf7) events.
+ * @return 0 on success, -1 on error
+ */
+int smf_writer_event (smf_writer *w, uint64_t time, const uint8_t *data, size_t size);
+
+/**
+ * finalize the track and close the file, frees w
+ * @return 0 on success, -1 on error
+ */
+int smf_writer_close (smf_writer *w);
+
+#endif
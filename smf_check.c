@@ -0,0 +1,140 @@
+/* round-trip check of the Standard MIDI File writer and reader
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* A clock stream with jitter, tempo ramps, transport messages and gaps
+ * is written with smf_writer and read back with smf_read(). Every event
+ * must come back within half a MIDI tick of its time (plus rounding to
+ * a sample), so within one sample if a tick is shorter than one sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "smf.h"
+
+#define SAMPLERATE (48000.0)
+#define N_EVENTS (200000)
+#define JITTER (20) ///< [samples] +- on clock ticks
+
+struct check {
+  uint64_t time[N_EVENTS];
+  uint8_t  msg[N_EVENTS];
+  int      n;
+  int      n_read;
+  double   max_err;
+  int      failed;
+};
+
+static void check_event(void *arg, int track, uint64_t time, const uint8_t *data, size_t size) {
+  struct check *c = (struct check*) arg;
+  if (c->n_read >= c->n || data[0] != c->msg[c->n_read]) {
+    c->failed = 1;
+    return;
+  }
+  const double err = fabs((double) time - (double) c->time[c->n_read]);
+  if (err > c->max_err) {
+    c->max_err = err;
+  }
+  ++c->n_read;
+}
+
+/**
+ * generate the stream: ramps between 100 and 200 BPM with jitter, stop/continue with song-position every few thousand ticks.
+ */
+static void generate(struct check *c) {
+  double t = 1000, bpm;
+  int i;
+  srand(1);
+  c->n = 0;
+  for (i = 0; c->n < N_EVENTS - 4; ++i) {
+    const double jitter = (rand() % (2 * JITTER + 1)) - JITTER;
+    if (i % 5000 == 4999) {
+      c->time[c->n] = t + JITTER + 10; c->msg[c->n++] = 0xfc;
+      c->time[c->n] = t + JITTER + 20; c->msg[c->n++] = 0xf2;
+      t += SAMPLERATE * (1 + rand() % 3);
+      c->time[c->n] = t;       c->msg[c->n++] = 0xfb;
+    }
+    bpm = 150 + 50 * sin(i / 3000.0);
+    t += SAMPLERATE * 60.0 / (24.0 * bpm);
+    c->time[c->n] = t + jitter; c->msg[c->n++] = 0xf8;
+  }
+}
+
+/**
+ * @return 0 if all events come back within the given bound
+ */
+static int roundtrip(struct check *c, const char *fn, int ppqn) {
+  /* the file's tempo follows single clock intervals: the longest tick
+   * is at the slowest tempo with the most jitter */
+  const double bound = 0.5 * (SAMPLERATE * 60.0 / (24.0 * 100.0) + 2 * JITTER) * 24.0 / ppqn + 0.5;
+  smf_writer *w;
+  int i;
+
+  if (!(w = smf_writer_open(fn, SAMPLERATE, ppqn))) {
+    fprintf(stderr, "cannot create '%s'\n", fn);
+    return -1;
+  }
+  for (i = 0; i < c->n; ++i) {
+    const uint8_t spp[3] = { 0xf2, 0x10, 0x02 };
+    if (smf_writer_event(w, c->time[i], c->msg[i] == 0xf2 ? spp : &c->msg[i], c->msg[i] == 0xf2 ? 3 : 1)) {
+      fprintf(stderr, "write error\n");
+      smf_writer_close(w);
+      return -1;
+    }
+  }
+  if (smf_writer_close(w)) {
+    fprintf(stderr, "error writing '%s'\n", fn);
+    return -1;
+  }
+
+  /* times are relative to the first event */
+  for (i = c->n - 1; i >= 0; --i) {
+    c->time[i] -= c->time[0];
+  }
+  c->n_read = 0;
+  c->max_err = 0;
+  c->failed = 0;
+  if (smf_read(fn, SAMPLERATE, check_event, c) || c->failed || c->n_read != c->n) {
+    fprintf(stderr, "ppqn %5d: read back %d of %d events\n", ppqn, c->n_read, c->n);
+    return -1;
+  }
+  printf("ppqn %5d: %d events, max error %.1f samples (bound %.1f)\n", ppqn, c->n, c->max_err, bound);
+  return c->max_err <= bound ? 0 : -1;
+}
+
+int main (int argc, char **argv) {
+  const char *fn = argc > 1 ? argv[1] : "smf_check.mid";
+  static struct check c;
+  const int ppqn[] = { 96, 960, 32000 };
+  int rv = 0;
+  int i;
+
+  for (i = 0; i < 3; ++i) {
+    generate(&c);
+    if (roundtrip(&c, fn, ppqn[i])) {
+      rv = 1;
+    }
+  }
+  remove(fn);
+  return rv;
+}
+/* vi:set ts=8 sts=2 sw=2: */
@@ -0,0 +1,315 @@
+/* tempo map and transport script for jack_midi_clock
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tempomap.h"
+
+/* tempo or meter change, as parsed */
+struct tm_change {
+  int32_t bar, beat; ///< 1 based
+  double  tick;
+  int     line;      ///< keeps order of equal positions
+  double  bpm;       ///< > 0 for tempo changes
+  float   beats_per_bar, beat_type; ///< > 0 for meter changes
+};
+
+/* locate target, resolved after the tempo map is complete */
+struct tm_bbt {
+  int32_t bar, beat;
+  double  tick;
+};
+
+static int cmp_change(const void *a, const void *b) {
+  const struct tm_change *x = (const struct tm_change*) a;
+  const struct tm_change *y = (const struct tm_change*) b;
+  if (x->bar != y->bar) return x->bar < y->bar ? -1 : 1;
+  if (x->beat != y->beat) return x->beat < y->beat ? -1 : 1;
+  if (x->tick != y->tick) return x->tick < y->tick ? -1 : 1;
+  return x->line - y->line;
+}
+
+/**
+ * stable sort by time, cues at the same time keep their order
+ */
+static void sort_cues(transport_cue *q, int n) {
+  int i, j;
+  for (i = 1; i < n; ++i) {
+    transport_cue t = q[i];
+    for (j = i; j > 0 && q[j - 1].time > t.time; --j) {
+      q[j] = q[j - 1];
+    }
+    q[j] = t;
+  }
+}
+
+/**
+ * parse "bar[|beat[|tick]]"
+ */
+static int parse_bbt(const char *s, struct tm_bbt *p) {
+  p->beat = 1;
+  p->tick = 0;
+  if (sscanf(s, "%d|%d|%lf", &p->bar, &p->beat, &p->tick) < 1) {
+    return -1;
+  }
+  if (p->bar < 1 || p->beat < 1 || p->tick < 0 || p->tick >= TEMPOMAP_TICKS_PER_BEAT) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * beats since the start of the segment's first bar
+ */
+static double seg_bar_offset(const tempo_segment *s) {
+  return s->bar_beat + s->bar_tick / TEMPOMAP_TICKS_PER_BEAT;
+}
+
+/**
+ * beats from the segment start to the given position, < 0 if before the segment
+ */
+static double seg_beats_to(const tempo_segment *s, int32_t bar, int32_t beat, double tick) {
+  return (bar - s->bar) * s->beats_per_bar + (beat - 1) + tick / TEMPOMAP_TICKS_PER_BEAT - seg_bar_offset(s);
+}
+
+/**
+ * @return 1 if the segment starts at or before the given position
+ */
+static int seg_starts_at_or_before(const tempo_segment *s, int32_t bar, int32_t beat, double tick) {
+  if (s->bar != bar) return s->bar < bar;
+  if (s->bar_beat != beat - 1) return s->bar_beat < beat - 1;
+  return s->bar_tick <= tick;
+}
+
+static int build_segments(tempomap *tm, struct tm_change *c, int n) {
+  tempo_segment *s;
+  int i;
+
+  tm->seg = (tempo_segment*) malloc((n + 1) * sizeof(tempo_segment));
+  if (!tm->seg) return -1;
+
+  s = &tm->seg[0];
+  memset(s, 0, sizeof(tempo_segment));
+  s->bar = 1;
+  s->bpm = 120;
+  s->beats_per_bar = 4;
+  s->beat_type = 4;
+  tm->n_seg = 1;
+
+  qsort(c, n, sizeof(struct tm_change), cmp_change);
+
+  for (i = 0; i < n; ++i) {
+    tempo_segment *cur = &tm->seg[tm->n_seg - 1];
+    const double db = seg_beats_to(cur, c[i].bar, c[i].beat, c[i].tick);
+
+    if (c[i].beat > cur->beats_per_bar) {
+      fprintf(stderr, "tempo map line %d: beat %d does not exist in %g/%g\n",
+	  c[i].line, c[i].beat, cur->beats_per_bar, cur->beat_type);
+      return -1;
+    }
+    if (db > 0) {
+      tempo_segment *nxt = &tm->seg[tm->n_seg++];
+      memcpy(nxt, cur, sizeof(tempo_segment));
+      nxt->frame = cur->frame + db * 60.0 * tm->samplerate / cur->bpm;
+      nxt->beat  = cur->beat + db;
+      nxt->bar   = c[i].bar;
+      nxt->bar_beat = c[i].beat - 1;
+      nxt->bar_tick = c[i].tick;
+      cur = nxt;
+    }
+    if (c[i].bpm > 0) {
+      cur->bpm = c[i].bpm;
+    } else {
+      cur->beats_per_bar = c[i].beats_per_bar;
+      cur->beat_type = c[i].beat_type;
+    }
+  }
+  return 0;
+}
+
+int tempomap_load (tempomap *tm, const char *fn, double samplerate) {
+  struct tm_change *chg = NULL;
+  struct tm_bbt *loc = NULL;
+  int n_chg = 0, n_alloc = 0;
+  int c_alloc = 0;
+  char line[1024];
+  int lineno = 0;
+  int i, rv = -1;
+  FILE *f;
+
+  memset(tm, 0, sizeof(tempomap));
+  tm->samplerate = samplerate;
+
+  if (!(f = fopen(fn, "r"))) {
+    fprintf(stderr, "cannot open tempo map '%s'\n", fn);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    char cmd[16], a1[64], a2[64];
+    char *hash;
+    int n;
+
+    ++lineno;
+    if ((hash = strchr(line, '#'))) *hash = '\0';
+    n = sscanf(line, "%15s %63s %63s", cmd, a1, a2);
+    if (n < 1) continue;
+
+    if (!strcmp(cmd, "tempo") || !strcmp(cmd, "meter")) {
+      struct tm_change *c;
+      struct tm_bbt p;
+      if (n != 3 || parse_bbt(a1, &p)) goto parse_error;
+      if (n_chg >= n_alloc) {
+	n_alloc = n_alloc ? 2 * n_alloc : 64;
+	if (!(c = (struct tm_change*) realloc(chg, n_alloc * sizeof(struct tm_change)))) goto out;
+	chg = c;
+      }
+      c = &chg[n_chg++];
+      memset(c, 0, sizeof(struct tm_change));
+      c->bar  = p.bar;
+      c->beat = p.beat;
+      c->tick = p.tick;
+      c->line = lineno;
+      if (cmd[0] == 't') {
+	c->bpm = atof(a2);
+	if (c->bpm < 1 || c->bpm > 1000) goto parse_error;
+      } else {
+	if (p.beat != 1 || p.tick != 0) goto parse_error; // meter changes on a bar
+	if (sscanf(a2, "%f/%f", &c->beats_per_bar, &c->beat_type) != 2) goto parse_error;
+	if (c->beats_per_bar < 1 || c->beats_per_bar > 64 || c->beat_type < 1 || c->beat_type > 64) goto parse_error;
+      }
+    }
+    else if (!strcmp(cmd, "start") || !strcmp(cmd, "stop") || !strcmp(cmd, "locate") || !strcmp(cmd, "end")
+	|| !strcmp(cmd, "freewheel")) {
+      transport_cue *q;
+      if (n < 2 || atof(a1) < 0) goto parse_error;
+      if (tm->n_cue >= c_alloc) {
+	struct tm_bbt *l;
+	c_alloc = c_alloc ? 2 * c_alloc : 64;
+	if (!(q = (transport_cue*) realloc(tm->cue, c_alloc * sizeof(transport_cue)))) goto out;
+	tm->cue = q;
+	if (!(l = (struct tm_bbt*) realloc(loc, c_alloc * sizeof(struct tm_bbt)))) goto out;
+	loc = l;
+      }
+      q = &tm->cue[tm->n_cue];
+      q->time  = atof(a1);
+      q->frame = 0;
+      if (!strcmp(cmd, "start")) q->type = TM_START;
+      else if (!strcmp(cmd, "stop")) q->type = TM_STOP;
+      else if (!strcmp(cmd, "end")) q->type = TM_END;
+      else if (!strcmp(cmd, "freewheel")) {
+	q->type = TM_FREEWHEEL;
+	if (n != 3 || (strcmp(a2, "on") && strcmp(a2, "off"))) goto parse_error;
+	q->frame = strcmp(a2, "on") ? 0 : 1;
+      }
+      else {
+	q->type = TM_LOCATE;
+	if (n != 3 || parse_bbt(a2, &loc[tm->n_cue])) goto parse_error;
+      }
+      ++tm->n_cue;
+    }
+    else {
+      goto parse_error;
+    }
+  }
+
+  if (build_segments(tm, chg, n_chg)) {
+    goto out;
+  }
+
+  /* resolve locate targets, then sort by time */
+  for (i = 0; i < tm->n_cue; ++i) {
+    transport_cue *q = &tm->cue[i];
+    if (q->type == TM_LOCATE) {
+      q->frame = floor(tempomap_bbt_to_frame(tm, loc[i].bar, loc[i].beat, loc[i].tick) + .5);
+    }
+  }
+  sort_cues(tm->cue, tm->n_cue);
+  rv = 0;
+  goto out;
+
+parse_error:
+  fprintf(stderr, "tempo map '%s' line %d: parse error\n", fn, lineno);
+
+out:
+  fclose(f);
+  free(chg);
+  free(loc);
+  if (rv) {
+    tempomap_free(tm);
+  }
+  return rv;
+}
+
+void tempomap_free (tempomap *tm) {
+  free(tm->seg);
+  free(tm->cue);
+  tm->seg = NULL;
+  tm->cue = NULL;
+  tm->n_seg = tm->n_cue = 0;
+}
+
+const tempo_segment *tempomap_segment (const tempomap *tm, double frame) {
+  int lo = 0, hi = tm->n_seg - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if (tm->seg[mid].frame <= frame) lo = mid;
+    else hi = mid - 1;
+  }
+  return &tm->seg[lo];
+}
+
+double tempomap_bbt_to_frame (const tempomap *tm, int32_t bar, int32_t beat, double tick) {
+  const tempo_segment *s;
+  int lo = 0, hi = tm->n_seg - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if (seg_starts_at_or_before(&tm->seg[mid], bar, beat, tick)) lo = mid;
+    else hi = mid - 1;
+  }
+  s = &tm->seg[lo];
+  return s->frame + seg_beats_to(s, bar, beat, tick) * 60.0 * tm->samplerate / s->bpm;
+}
+
+void tempomap_position (const tempomap *tm, jack_position_t *pos) {
+  tempomap_position_at (tm, pos->frame, pos);
+}
+
+void tempomap_position_at (const tempomap *tm, double frame, jack_position_t *pos) {
+  const tempo_segment *s = tempomap_segment(tm, frame);
+  const double db = (frame - s->frame) * s->bpm / (60.0 * tm->samplerate);
+  const double rel = seg_bar_offset(s) + db; // beats since the start of s->bar
+  const int32_t bars = (int32_t) floor(rel / s->beats_per_bar);
+  const double in_bar = rel - bars * s->beats_per_bar;
+  const double bar_start = s->beat + db - in_bar; // beats since 1|1|0
+
+  pos->valid |= JackPositionBBT;
+  pos->bar  = s->bar + bars;
+  pos->beat = 1 + (int32_t) floor(in_bar);
+  pos->tick = (int32_t) floor((in_bar - floor(in_bar)) * TEMPOMAP_TICKS_PER_BEAT);
+  pos->bar_start_tick   = bar_start * TEMPOMAP_TICKS_PER_BEAT;
+  pos->beats_per_bar    = s->beats_per_bar;
+  pos->beat_type        = s->beat_type;
+  pos->ticks_per_beat   = TEMPOMAP_TICKS_PER_BEAT;
+  pos->beats_per_minute = s->bpm;
+}
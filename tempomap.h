@@ -0,0 +1,102 @@
+/* tempo map and transport script for jack_midi_clock
+ *
+ * Copyright (C) 2026 jack_midi_clock contributors, see the git history
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef TEMPOMAP_H
+#define TEMPOMAP_H
+
+#include <stdint.h>
+#include <jack/transport.h>
+
+#define TEMPOMAP_TICKS_PER_BEAT (1920.0)
+
+/* section of constant tempo and meter */
+typedef struct {
+  double  frame;  ///< transport frame at segment start
+  double  beat;   ///< beats since 1|1|0 at segment start
+  int32_t bar;    ///< bar at segment start, the segment starts on a bar if the meter changes
+  int32_t bar_beat; ///< beat-within-bar at segment start (0 based)
+  double  bar_tick; ///< tick-within-beat at segment start
+  double  bpm;    ///< beats per minute
+  float   beats_per_bar;
+  float   beat_type;
+} tempo_segment;
+
+/* transport script */
+enum {
+  TM_START = 0, /**< start transport */
+  TM_STOP,      /**< stop transport */
+  TM_LOCATE,    /**< locate to frame */
+  TM_FREEWHEEL, /**< enter or leave freewheel mode */
+  TM_END        /**< end of script */
+};
+
+typedef struct {
+  double time;  ///< seconds since the beginning of the script
+  int    type;  ///< TM_*
+  double frame; ///< TM_LOCATE: transport frame, TM_FREEWHEEL: 1 on, 0 off
+} transport_cue;
+
+typedef struct {
+  double samplerate;
+  tempo_segment *seg; ///< sorted by frame
+  int n_seg;
+  transport_cue *cue; ///< sorted by time
+  int n_cue;
+} tempomap;
+
+/**
+ * parse a tempo map file, one command per line:
+ *   tempo <bar>[|<beat>[|<tick>]] <bpm>
+ *   meter <bar> <beats-per-bar>/<beat-type>
+ *   start <sec>
+ *   stop <sec>
+ *   locate <sec> <bar>[|<beat>[|<tick>]]
+ *   freewheel <sec> on|off
+ *   end <sec>
+ * '#' starts a comment. The tempo map starts at 1|1|0 with 120 BPM 4/4.
+ * @return 0 on success, -1 on error (a message is printed)
+ */
+int tempomap_load (tempomap *tm, const char *fn, double samplerate);
+
+void tempomap_free (tempomap *tm);
+
+/**
+ * find the segment that contains the given transport frame, O(log n)
+ */
+const tempo_segment *tempomap_segment (const tempomap *tm, double frame);
+
+/**
+ * transport frame of a musical position, O(log n)
+ */
+double tempomap_bbt_to_frame (const tempomap *tm, int32_t bar, int32_t beat, double tick);
+
+/**
+ * set bar, beat, tick, tempo and meter of pos at pos->frame
+ * and flag JackPositionBBT as valid.
+ */
+void tempomap_position (const tempomap *tm, jack_position_t *pos);
+
+/**
+ * as tempomap_position(), at the given frame of the map
+ * (e.g. pos->frame scaled to the map's sample-rate).
+ */
+void tempomap_position_at (const tempomap *tm, double frame, jack_position_t *pos);
+
+#endif